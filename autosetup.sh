@@ -230,6 +230,9 @@ for instance in $INSTANCES; do
 		export METALLOC_OPTIONS="-DFIXEDCOMPRESSION=$CONFIG_FIXEDCOMPRESSION -DMETADATABYTES=$CONFIG_METADATABYTES -DDEEPMETADATA=$CONFIG_DEEPMETADATA"
 		[ "true" = "$CONFIG_DEEPMETADATA" ] && METALLOC_OPTIONS="$METALLOC_OPTIONS -DDEEPMETADATABYTES=$CONFIG_DEEPMETADATABYTES"
 		[ -n "$CONFIG_ALLOC_SIZE_HOOK" ] && METALLOC_OPTIONS="$METALLOC_OPTIONS -DALLOC_SIZE_HOOK=$CONFIG_ALLOC_SIZE_HOOK"
+		[ -n "$CONFIG_PTRBITS" ] && METALLOC_OPTIONS="$METALLOC_OPTIONS -DPTRBITS=$CONFIG_PTRBITS"
+		[ -n "$CONFIG_ALLOC_HOOK" ] && METALLOC_OPTIONS="$METALLOC_OPTIONS -DALLOC_HOOK=$CONFIG_ALLOC_HOOK"
+		[ -n "$CONFIG_RESIZE_HOOK" ] && METALLOC_OPTIONS="$METALLOC_OPTIONS -DRESIZE_HOOK=$CONFIG_RESIZE_HOOK"
 		metapagetabledir="$PATHAUTOFRAMEWORKOBJ/metapagetable-$instance"
 		run make OBJDIR="$metapagetabledir" config
 		run make OBJDIR="$metapagetabledir" -j"$JOBS"
@@ -144,8 +144,10 @@ void CentralFreeList::ReleaseToSpans(void* object) {
       if (!FLAGS_METALLOC_FIXEDCOMPRESSION) {
           unsigned long metaentry = get_metapagetable_entry((void*)(span->start << kPageShift));
           set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift, 0, 0);
-          Span* metaspan = MapObjectToSpan((void*)(metaentry >> 8));
-          Static::pageheap()->Delete(metaspan);
+          int alignment = metaentry & 0xFF;
+          int rounding_offset = (1 << alignment) - 1;
+          Static::pageheap()->DeleteMetadata((void*)(metaentry >> 8),
+              (span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
       }
 
       Static::pageheap()->Delete(span);
@@ -344,10 +346,10 @@ void CentralFreeList::Populate() {
       if (!FLAGS_METALLOC_FIXEDCOMPRESSION) {
           int alignment = std::min<int>(AlignmentBitsForSize(Static::sizemap()->ByteSizeForClass(size_class_)), kPageShift);
           int rounding_offset = (1 << alignment) - 1;
-          Span* metaspan = Static::pageheap()->New((span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
-          if (metaspan != NULL) {  
-            set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift, 
-                  (void*)(metaspan->start << kPageShift), alignment);
+          void* metadata = Static::pageheap()->NewMetadata((span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
+          if (metadata != NULL) {
+            set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift,
+                  metadata, alignment);
           } else {
             Static::pageheap()->Delete(span);
             span = NULL;
@@ -43,6 +43,7 @@
 #include "page_heap_allocator.h"  // for PageHeapAllocator
 #include "static_vars.h"       // for Static
 #include "system-alloc.h"      // for TCMalloc_SystemAlloc, etc
+#include <metapagetable.h>     // for allocate_metadata_arena, etc
 
 DEFINE_double(tcmalloc_release_rate,
               EnvToDouble("TCMALLOC_RELEASE_RATE", 1.0),
@@ -320,6 +321,26 @@ void PageHeap::Delete(Span* span) {
   ASSERT(Check());
 }
 
+void* PageHeap::NewMetadata(Length n) {
+#if FLAGS_METALLOC_PTRBITS > 32
+  return allocate_metadata_arena(n << kPageShift);
+#else
+  Span* metaspan = New(n);
+  if (metaspan == NULL) return NULL;
+  return reinterpret_cast<void*>(metaspan->start << kPageShift);
+#endif
+}
+
+void PageHeap::DeleteMetadata(void* metadata, Length n) {
+#if FLAGS_METALLOC_PTRBITS > 32
+  deallocate_metadata_arena(metadata, n << kPageShift);
+#else
+  Span* metaspan = GetDescriptor(reinterpret_cast<uintptr_t>(metadata) >> kPageShift);
+  ASSERT(metaspan != NULL && metaspan->length == n);
+  Delete(metaspan);
+#endif
+}
+
 bool PageHeap::MayMergeSpans(Span *span, Span *other) {
   if (aggressive_decommit_) {
     return other->location != Span::IN_USE;
@@ -115,6 +115,15 @@ class PERFTOOLS_DLL_DECL PageHeap {
   //           has not yet been deleted.
   void Delete(Span* span);
 
+  // Allocate the metadata of a span, "n" pages of it. It comes from the
+  // heap itself, or from the metadata arena of metapagetable when fat
+  // pointers store arena offsets (FLAGS_METALLOC_PTRBITS > 32).
+  // Returns NULL if out of memory.
+  void* NewMetadata(Length n);
+
+  // Delete metadata of "n" pages returned by an earlier NewMetadata().
+  void DeleteMetadata(void* metadata, Length n);
+
   // Mark an allocated span as being used for small objects of the
   // specified size-class.
   // REQUIRES: span was returned by an earlier call to New()
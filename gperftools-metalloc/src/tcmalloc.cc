@@ -1161,10 +1161,10 @@ inline void* do_malloc_pages(ThreadCache* heap, size_t &size) {
         if (span != NULL) {
           int alignment = kPageShift;
           int rounding_offset = (1 << alignment) - 1;
-          Span* metaspan = Static::pageheap()->New((span->length * FLAGS_METALLOC_METADATABYTES  + rounding_offset) >> alignment);
-          if (metaspan != 0) {
-            set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift, 
-                (void*)(metaspan->start << kPageShift), alignment);
+          void* metadata = Static::pageheap()->NewMetadata((span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
+          if (metadata != NULL) {
+            set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift,
+                metadata, alignment);
           } else {
             Static::pageheap()->Delete(span);
             span = NULL;
@@ -1218,7 +1218,12 @@ static ALWAYS_INLINE void* reset_metadata(ThreadCache* heap, void *ptr, unsigned
   unsigned long *deepmetadata = NULL;
   if (!FLAGS_METALLOC_FIXEDCOMPRESSION) {
     if (FLAGS_METALLOC_DEEPMETADATA) {
-      deepmetadata = (unsigned long*)do_malloc_metadata(heap, FLAGS_METALLOC_DEEPMETADATABYTES);
+      // Fat pointers with more than 32 address bits can only refer to deep
+      // metadata in the metadata arena
+      if (FLAGS_METALLOC_PTRBITS > 32)
+        deepmetadata = (unsigned long*)allocate_deep_metadata();
+      else
+        deepmetadata = (unsigned long*)do_malloc_metadata(heap, FLAGS_METALLOC_DEEPMETADATABYTES);
     }
   }
   METALLOC_ALLOC_HOOK(ptr, deepmetadata, content_size, allocation_size);
@@ -1379,7 +1384,10 @@ ALWAYS_INLINE void do_free_helper(void* ptr,
   }
 
   if (FLAGS_METALLOC_DEEPMETADATA && !FLAGS_METALLOC_FIXEDCOMPRESSION) {
-    do_free_metadata(get_deepmetadata_ptr(ptr), invalid_free_fn, heap, heap_must_be_valid);
+    if (FLAGS_METALLOC_PTRBITS > 32)
+      deallocate_deep_metadata(get_deepmetadata_ptr(ptr));
+    else
+      do_free_metadata(get_deepmetadata_ptr(ptr), invalid_free_fn, heap, heap_must_be_valid);
     METALLOC_ALLOC_HOOK(ptr, 0, 0, Static::sizemap()->class_to_size(cl));
   }
 #ifdef METALLOC_FREE_HOOK
@@ -1408,9 +1416,10 @@ ALWAYS_INLINE void do_free_helper(void* ptr,
     if (!FLAGS_METALLOC_FIXEDCOMPRESSION) {
         unsigned long metaentry = get_metapagetable_entry((void*)(span->start << kPageShift));
         set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift, 0, 0);
-        const PageID metapage = (metaentry >> 8) >> kPageShift;
-        Span* metaspan = Static::pageheap()->GetDescriptor(metapage);
-        Static::pageheap()->Delete(metaspan);
+        int alignment = metaentry & 0xFF;
+        int rounding_offset = (1 << alignment) - 1;
+        Static::pageheap()->DeleteMetadata((void*)(metaentry >> 8),
+            (span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
     }
 
     Static::pageheap()->Delete(span);
@@ -1509,7 +1518,7 @@ ALWAYS_INLINE void* do_realloc_with_callback(
     return new_ptr;
   } else {
 #ifdef METALLOC_RESIZE_HOOK
-  new_size = METALLOC_RESIZE_HOOK(ptr, content_size, old_size);
+  METALLOC_RESIZE_HOOK(old_ptr, content_size, old_size);
 #endif
     // We still need to call hooks to report the updated size:
     MallocHook::InvokeDeleteHook(old_ptr);
@@ -1584,10 +1593,10 @@ void* do_memalign(size_t align, size_t size) {
         if (span != NULL) {
           int alignment = kPageShift;
           int rounding_offset = (1 << alignment) - 1;
-          Span* metaspan = Static::pageheap()->New((span->length * FLAGS_METALLOC_METADATABYTES  + rounding_offset) >> alignment);
-          if (metaspan != 0) {
-            set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift, 
-                (void*)(metaspan->start << kPageShift), alignment);
+          void* metadata = Static::pageheap()->NewMetadata((span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
+          if (metadata != NULL) {
+            set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift,
+                metadata, alignment);
             ThreadCache* heap = ThreadCache::GetCache();
             reset_metadata(heap, (void*)(span->start << kPageShift), content_size, span->length << kPageShift);
           } else {
@@ -1629,10 +1638,10 @@ void* do_memalign(size_t align, size_t size) {
       if (span != NULL) {
         int alignment = kPageShift;
         int rounding_offset = (1 << alignment) - 1;
-        Span* metaspan = Static::pageheap()->New((span->length * FLAGS_METALLOC_METADATABYTES  + rounding_offset) >> alignment);
-        if (metaspan != 0) {
-          set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift, 
-             (void*)(metaspan->start << kPageShift), alignment);
+        void* metadata = Static::pageheap()->NewMetadata((span->length * FLAGS_METALLOC_METADATABYTES + rounding_offset) >> alignment);
+        if (metadata != NULL) {
+          set_metapagetable_entries((void*)(span->start << kPageShift), span->length << kPageShift,
+             metadata, alignment);
           ThreadCache* heap = ThreadCache::GetCache();
           reset_metadata(heap, (void*)(span->start << kPageShift), content_size, span->length << kPageShift);
         } else {
@@ -0,0 +1,330 @@
+/*
+ * BoundsChecks.cpp
+ *
+ * Bounds checks for loads and stores against the bounds that
+ * bounds_alloc_hook (metapagetable/boundshooks.c) stores in the metadata of
+ * heap objects. The checks (staticlib/boundscheck.c) take the pointer before
+ * masking, so with MidFatPtrs they read the bounds through its high bits
+ * without a page table lookup.
+ *
+ * Accesses through pointers that are never fat (Provenance) and at constant
+ * offsets within stack and global objects have no bounds and are not checked.
+ * Of the rest, an access is not checked again when a check of the same
+ * iteration dominates it and covers its bytes, by SCEV of the two pointers
+ * being a constant apart, and accesses to affine addresses in loops without
+ * calls are checked once for the whole loop in the preheader.
+ */
+
+#include <llvm/Pass.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Constant.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/CallSite.h>
+#include <llvm/ADT/DepthFirstIterator.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolutionExpander.h>
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <Utils.h>
+#include <metadata.h>
+
+#include "Provenance.h"
+#include "ExtFuncModel.h"
+
+#define DEBUG_TYPE "BoundsChecks"
+
+using namespace llvm;
+
+static cl::opt<bool> EliminateBoundsChecks("boundschecks-eliminate",
+        cl::desc("Do not check accesses covered by a dominating check"),
+        cl::init(true));
+
+static cl::opt<bool> HoistBoundsChecks("boundschecks-hoist",
+        cl::desc("Check the address range of affine accesses in loops once before the loop"),
+        cl::init(true));
+
+struct BoundsChecks : public FunctionPass {
+    static char ID;
+    bool initialized;
+    Module *M;
+    const DataLayout *DL;
+    Type *VoidTy;
+    IntegerType *IntPtrTy;
+    ExtFuncModel Model;
+    Provenance P;
+
+    int checked = 0;
+    int thin = 0;
+    int knownObject = 0;
+    int eliminated = 0;
+    int rangeChecked = 0;
+    int rangeChecks = 0;
+
+    //declare void @boundscheck(i64, i64)
+    Constant *BoundscheckFunc;
+    //declare void @boundscheck_range(i64, i64)
+    Constant *BoundscheckRangeFunc;
+
+    // A check of Size bytes at Ptr, by SCEV base of Ptr
+    struct Check {
+        Instruction *At;
+        const SCEV *Ptr;
+        uint64_t Size;
+    };
+    std::map<const SCEV*, std::vector<Check> > checks;
+
+    BoundsChecks() : FunctionPass(ID) { initialized = false; }
+
+    // Get the pointer and size of a load or store
+    Value *GetAccess(Instruction *I, uint64_t *size) {
+        if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
+            *size = DL->getTypeStoreSize(LI->getType());
+            return LI->getPointerOperand();
+        }
+        if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+            *size = DL->getTypeStoreSize(SI->getValueOperand()->getType());
+            return SI->getPointerOperand();
+        }
+        return NULL;
+    }
+
+    // Only heap objects have bounds
+    bool NeedsCheck(Value *ptr, uint64_t size) {
+        return P.get(ptr) != Provenance::Thin && !isKnownObjectAccess(ptr, size, *DL);
+    }
+
+    // Calls may leave the loop early, so only loops without them get their
+    // checks hoisted
+    bool HasCalls(Loop *L) {
+        for (BasicBlock *BB : L->blocks()) {
+            for (auto &i : *BB) {
+                if (!isa<CallInst>(&i) && !isa<InvokeInst>(&i))
+                    continue;
+                ImmutableCallSite CS(&i);
+                const Function *callee = CS.getCalledFunction();
+                if (isa<DbgInfoIntrinsic>(&i) ||
+                        (callee && ISMETADATAFUNC(callee->getName().str().c_str())))
+                    continue;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Check if an access in a loop is to an affine address on every iteration
+    // of a loop with a computable trip count, and if so get the byte range it
+    // accesses over all iterations
+    bool GetLoopAccessRange(Instruction *I, Value *ptr, uint64_t size, Loop *L,
+            DominatorTree *DT, ScalarEvolution *SE, const SCEV **lo, const SCEV **hi) {
+        // Without early exits, the access runs exactly once per iteration
+        if (!L->getLoopPreheader() || !L->getLoopLatch() ||
+                L->getExitingBlock() != L->getLoopLatch() ||
+                !DT->dominates(I->getParent(), L->getLoopLatch()))
+            return false;
+
+        const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(ptr));
+        if (!AR || AR->getLoop() != L || !AR->isAffine())
+            return false;
+        const SCEVConstant *step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+        if (!step)
+            return false;
+
+        const SCEV *BTC = SE->getBackedgeTakenCount(L);
+        if (isa<SCEVCouldNotCompute>(BTC))
+            return false;
+
+        const SCEV *first = AR->getStart();
+        const SCEV *last = AR->evaluateAtIteration(BTC, *SE);
+        Type *Ty = SE->getEffectiveSCEVType(AR->getType());
+        if (step->getValue()->isNegative())
+            std::swap(first, last);
+        *lo = first;
+        *hi = SE->getAddExpr(last, SE->getConstant(Ty, size));
+
+        return isSafeToExpand(*lo, *SE) && isSafeToExpand(*hi, *SE);
+    }
+
+    // Replace the per-iteration checks of accesses in loops by a single range
+    // check in the preheader. The range is checked against the bounds of the
+    // object of its lowest address.
+    void HoistChecks(Function &F, LoopInfo *LI, DominatorTree *DT,
+            ScalarEvolution *SE, std::set<const Instruction*> &hoisted) {
+        std::map<Loop*, bool> loopHasCalls;
+        std::set<std::pair<const SCEV*, const SCEV*> > emitted;
+        SCEVExpander Expander(*SE, *DL, "boundsrange");
+
+        for (auto &i : instructions(F)) {
+            uint64_t size;
+            Value *ptr = GetAccess(&i, &size);
+            if (!ptr)
+                continue;
+            Loop *L = LI->getLoopFor(i.getParent());
+            if (!L || !NeedsCheck(ptr, size))
+                continue;
+
+            if (!loopHasCalls.count(L))
+                loopHasCalls[L] = HasCalls(L);
+            if (loopHasCalls[L])
+                continue;
+
+            const SCEV *lo, *hi;
+            if (!GetLoopAccessRange(&i, ptr, size, L, DT, SE, &lo, &hi))
+                continue;
+
+            hoisted.insert(&i);
+            if (!emitted.insert(std::make_pair(lo, hi)).second)
+                continue;
+
+            Instruction *insertPt = L->getLoopPreheader()->getTerminator();
+            std::vector<Value *> callParams;
+            callParams.push_back(Expander.expandCodeFor(lo, IntPtrTy, insertPt));
+            callParams.push_back(Expander.expandCodeFor(hi, IntPtrTy, insertPt));
+            CallInst::Create(BoundscheckRangeFunc, callParams, "", insertPt);
+            rangeChecks++;
+        }
+    }
+
+    // Find a check that dominates an access in the same loop iteration and
+    // covers all of its bytes. The bounds of an object only change when it is
+    // freed or reallocated, after which the program may no longer use
+    // pointers to it, so checks stay valid across calls.
+    bool IsCovered(Instruction *I, const SCEV *ptr, uint64_t size,
+            DominatorTree *DT, LoopInfo *LI, ScalarEvolution *SE) {
+        auto it = checks.find(SE->getPointerBase(ptr));
+        if (it == checks.end())
+            return false;
+
+        for (Check &C : it->second) {
+            Loop *L = LI->getLoopFor(C.At->getParent());
+            if ((L && !L->contains(I)) || !DT->dominates(C.At, I))
+                continue;
+            const SCEVConstant *diff = dyn_cast<SCEVConstant>(SE->getMinusSCEV(ptr, C.Ptr));
+            if (!diff)
+                continue;
+            int64_t offset = diff->getValue()->getSExtValue();
+            if (offset >= 0 && (uint64_t)offset + size <= C.Size)
+                return true;
+        }
+        return false;
+    }
+
+    virtual bool runOnFunction(Function &F) {
+        if (!initialized)
+            doInitialization(F.getParent());
+
+        if (ISMETADATAFUNC(F.getName().str().c_str()))
+            return false;
+
+        DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+        LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+        ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+        std::set<const Instruction*> hoisted;
+        if (HoistBoundsChecks)
+            HoistChecks(F, LI, DT, SE, hoisted);
+
+        // Visit dominating checks before the accesses they dominate
+        std::vector<Instruction*> accesses;
+        for (auto *Node : depth_first(DT->getRootNode()))
+            for (auto &i : *Node->getBlock())
+                if (isa<LoadInst>(&i) || isa<StoreInst>(&i))
+                    accesses.push_back(&i);
+
+        checks.clear();
+        for (Instruction *I : accesses) {
+            uint64_t size;
+            Value *ptr = GetAccess(I, &size);
+            if (hoisted.count(I)) {
+                rangeChecked++;
+                continue;
+            }
+            if (P.get(ptr) == Provenance::Thin) {
+                thin++;
+                continue;
+            }
+            if (isKnownObjectAccess(ptr, size, *DL)) {
+                knownObject++;
+                continue;
+            }
+
+            const SCEV *ptrSCEV = SE->getSCEV(ptr);
+            if (EliminateBoundsChecks && IsCovered(I, ptrSCEV, size, DT, LI, SE)) {
+                eliminated++;
+                continue;
+            }
+
+            IRBuilder<> B(I);
+            std::vector<Value *> callParams;
+            callParams.push_back(B.CreatePtrToInt(ptr, IntPtrTy));
+            callParams.push_back(ConstantInt::get(IntPtrTy, size));
+            Instruction *check = B.CreateCall(BoundscheckFunc, callParams);
+            checks[SE->getPointerBase(ptrSCEV)].push_back({check, ptrSCEV, size});
+            checked++;
+        }
+
+        DEBUG(errs() << "Checked: " << checked << "  Thin: " << thin <<
+                "  Known object: " << knownObject << "  Eliminated: " << eliminated <<
+                "  Range checked: " << rangeChecked << " (" << rangeChecks << " checks)\n");
+
+        return true;
+    }
+
+    bool doInitialization(Module *Mod) {
+        M = Mod;
+
+        DL = &(M->getDataLayout());
+        if (!DL)
+            report_fatal_error("Data layout required");
+
+        if (FixedCompression || DeepMetadata ||
+                (MetadataBytes != 8 && MetadataBytes != 16))
+            report_fatal_error("boundschecks requires 8- or 16-byte metadata");
+        if (MetadataBytes == 8 && PtrBits > 32)
+            report_fatal_error("boundschecks with 8-byte metadata requires METALLOC_PTRBITS=32");
+
+        // Type definitions
+        VoidTy = Type::getVoidTy(M->getContext());
+        IntPtrTy = DL->getIntPtrType(M->getContext(), 0);
+
+        std::string functionName;
+        //declare void @boundscheck(i64, i64)
+        functionName = "boundscheck_" + std::to_string(MetadataBytes);
+        BoundscheckFunc = M->getOrInsertFunction(functionName, VoidTy, IntPtrTy, IntPtrTy, NULL);
+        //declare void @boundscheck_range(i64, i64)
+        functionName = "boundscheck_range_" + std::to_string(MetadataBytes);
+        BoundscheckRangeFunc = M->getOrInsertFunction(functionName, VoidTy, IntPtrTy, IntPtrTy, NULL);
+
+        // Before any function is instrumented
+        Model.load();
+        P.analyze(*M, &Model);
+
+        initialized = true;
+
+        return false;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<ScalarEvolutionWrapperPass>();
+        AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<LoopInfoWrapperPass>();
+    }
+
+};
+
+char BoundsChecks::ID = 0;
+static RegisterPass<BoundsChecks> X("boundschecks", "Bounds Checks Pass", false, false);
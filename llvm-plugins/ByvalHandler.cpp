@@ -28,6 +28,7 @@
 #include <vector>
 
 #include <Utils.h>
+#include <SafetySummaries.h>
 
 using namespace llvm;
 
@@ -37,6 +38,7 @@ struct ByvalHandler : public FunctionPass {
     Module *M;
     const DataLayout *DL;
     SafetyManager *SM;
+    SafetySummaries Summaries;
     Type* VoidTy;
     IntegerType *Int1Ty;
     IntegerType *Int8Ty;
@@ -53,7 +55,7 @@ struct ByvalHandler : public FunctionPass {
         if (!initialized)
             doInitialization(F.getParent());
 
-        SM = new SafetyManager(DL, &getAnalysis<ScalarEvolutionWrapperPass>().getSE());
+        SM = new SafetyManager(DL, &getAnalysis<ScalarEvolutionWrapperPass>().getSE(), &Summaries);
                       
         for (auto &a : F.args()) {
             Argument *Arg = dyn_cast<Argument>(&a);
@@ -98,6 +100,9 @@ struct ByvalHandler : public FunctionPass {
         Type *Tys[] = { PtrVoidTy, PtrVoidTy, IntPtrTy };
         MemcpyFunc = Intrinsic::getDeclaration(M, Intrinsic::memcpy, Tys);
 
+        if (UseSafetySummaries)
+            Summaries.compute(*M);
+
         initialized = true;
         
         return false;
@@ -6,36 +6,124 @@
  */
 
 #include <llvm/Transforms/IPO/InlinerPass.h>
+#include <llvm/Analysis/CallGraph.h>
 #include <llvm/Analysis/InlineCost.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Support/CommandLine.h>
 
+#include <map>
+
+#include <Utils.h>
 #include <metadata.h>
 
 using namespace llvm;
 
+static cl::opt<bool> InlineApplication("custominline-app",
+        cl::desc("Inline application functions using the standard cost model"),
+        cl::init(true));
+
+static cl::opt<unsigned> InstrumentationBonus("custominline-instr-bonus",
+        cl::desc("Percentage of the cost of instrumentation added to the inline threshold of its function"),
+        cl::init(100));
+
+static bool isInstrumentationHelper(const Function *F) {
+    StringRef func_name = F->getName();
+    return ISMETADATAFUNC(func_name.str().c_str()) ||
+        func_name == "lookup_metaptr" ||
+        func_name == "checkptr";
+}
+
+/* Masks of MidFatPtrs and MaskPointers (with the overflow bit) */
+static bool isPointerMask(const Instruction &I) {
+    if (I.getOpcode() != Instruction::And)
+        return false;
+    const ConstantInt *C = dyn_cast<ConstantInt>(I.getOperand(1));
+    if (!C || C->getBitWidth() != 64)
+        return false;
+    uint64_t Mask = C->getZExtValue();
+    return Mask == ptrMask() || Mask == (ptrMask() | (1ULL << 63));
+}
+
+static int instructionCost(const Function &F) {
+    int Cost = 0;
+    for (const BasicBlock &BB : F)
+        Cost += BB.size() * InlineConstants::InstrWeight;
+    return Cost;
+}
+
+/*
+ * Estimate of the cost that instrumentation added to a function, as the
+ * inlined size of its calls to metadata helpers plus its pointer masks.
+ */
+static int instrumentationCost(const Function &F) {
+    int Cost = 0;
+    for (const BasicBlock &BB : F) {
+        for (const Instruction &I : BB) {
+            ImmutableCallSite CS(&I);
+            const Function *Callee = CS ? CS.getCalledFunction() : nullptr;
+            if (Callee && isInstrumentationHelper(Callee))
+                Cost += InlineConstants::CallPenalty + instructionCost(*Callee);
+            else if (isPointerMask(I))
+                Cost += InlineConstants::InstrWeight;
+        }
+    }
+    return Cost;
+}
+
+/*
+ * Inliner for instrumented code. Metadata helpers are always inlined. Other
+ * functions are inlined according to the standard cost model, with the
+ * threshold raised by the cost of the instrumentation in the callee, so that
+ * the same application functions are inlined as in an uninstrumented build.
+ * The instrumentation cost is measured before anything is inlined, because
+ * the helpers are no longer recognizable once they are inlined.
+ */
 struct CustomInliner : public Inliner {
     static char ID;
 
     CustomInliner() : Inliner(ID) {}
 
-    InlineCost getInlineCost(CallSite CS) {
-        if (Function *Callee = CS.getCalledFunction()) {
-            StringRef func_name = Callee->getName();
-            if (ISMETADATAFUNC(func_name.str().c_str()) ||
-                    func_name == "lookup_metaptr" ||
-                    func_name == "checkptr") {
-                return InlineCost::getAlways();
-            }
-	}
-
-        return InlineCost::getNever();
+    bool doInitialization(CallGraph &CG) override {
+        Bonus.clear();
+        for (Function &F : CG.getModule()) {
+            if (!F.isDeclaration())
+                Bonus[&F] = instrumentationCost(F) * (int)InstrumentationBonus / 100;
+        }
+        return Inliner::doInitialization(CG);
     }
 
+    bool runOnSCC(CallGraphSCC &SCC) override {
+        TTIWP = &getAnalysis<TargetTransformInfoWrapperPass>();
+        return Inliner::runOnSCC(SCC);
+    }
 
-};
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<TargetTransformInfoWrapperPass>();
+        Inliner::getAnalysisUsage(AU);
+    }
 
-char CustomInliner::ID = 0;
-static RegisterPass<CustomInliner> X("custominline", "Custom Inliner Pass", true, false);
+    InlineCost getInlineCost(CallSite CS) override {
+        Function *Callee = CS.getCalledFunction();
+        if (!Callee)
+            return InlineCost::getNever();
 
+        if (isInstrumentationHelper(Callee))
+            return InlineCost::getAlways();
 
+        if (!InlineApplication)
+            return InlineCost::getNever();
 
+        auto it = Bonus.find(Callee);
+        int Threshold = getInlineThreshold(CS) + (it == Bonus.end() ? 0 : it->second);
+        return llvm::getInlineCost(CS, Threshold, TTIWP->getTTI(*Callee), ACT);
+    }
+
+private:
+    TargetTransformInfoWrapperPass *TTIWP;
+    std::map<const Function*, int> Bonus;
+};
 
+char CustomInliner::ID = 0;
+static RegisterPass<CustomInliner> X("custominline", "Custom Inliner Pass", true, false);
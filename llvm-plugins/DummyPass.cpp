@@ -16,6 +16,7 @@
 #include <llvm/IR/Constant.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/CallSite.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
 #include <llvm/Support/raw_ostream.h>
@@ -24,6 +25,9 @@
 #include <llvm/Transforms/Utils/Local.h>
 #include <llvm/Transforms/Utils/ModuleUtils.h>
 #include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolutionExpander.h>
 
 #include <string>
 #include <list>
@@ -31,6 +35,7 @@
 #include <vector>
 
 #include <Utils.h>
+#include <SafetySummaries.h>
 #include <metadata.h>
 
 #define DEBUG_TYPE "DummyPass"
@@ -38,6 +43,9 @@
 using namespace llvm;
 
 cl::opt<bool> OnlyPointerWrites ("METALLOC_ONLYPOINTERWRITES", cl::desc("Track only pointer writes"), cl::init(false));
+cl::opt<bool> CoalesceChecks ("METALLOC_COALESCECHECKS", cl::desc("Check stores to the same metadata granule of an object once per basic block"), cl::init(true));
+cl::opt<bool> HoistLoopChecks ("METALLOC_HOISTLOOPCHECKS", cl::desc("Check the address range of affine stores in loops once before the loop"), cl::init(true));
+cl::opt<bool> MetabaseCaching ("METALLOC_METABASECACHING", cl::desc("Fetch the metabase once per root pointer and check derived stores with metaget_base"), cl::init(true));
 
 struct DummyPass : public FunctionPass {
     static char ID;
@@ -45,6 +53,7 @@ struct DummyPass : public FunctionPass {
     Module *M;
     const DataLayout *DL;
     SafetyManager *SM;
+    SafetySummaries Summaries;
     Type* VoidTy;
     IntegerType *Int1Ty;
     IntegerType *Int8Ty;
@@ -57,6 +66,9 @@ struct DummyPass : public FunctionPass {
     int untracked = 0;
     int optimized = 0;
     int unoptimized = 0;
+    int merged = 0;
+    int rangeChecked = 0;
+    int rangeChecks = 0;
 
     //declare i64 @metabaseget(i64)
     Constant *MetabasegetFunc;
@@ -66,6 +78,8 @@ struct DummyPass : public FunctionPass {
     Constant *MetagetWithBaseFunc;
     //declare void @meta_check(iM, iM)
     Constant *MetacheckFunc;
+    //declare void @metacheck_range(i64, i64, iM)
+    Constant *MetacheckRangeFunc;
     //declare i64 @metaset_alignment(i64, i64, iM, i64)
     Constant *MetasetFunc;
 
@@ -210,8 +224,10 @@ struct DummyPass : public FunctionPass {
             CallInst *CI = dyn_cast<CallInst>(&i);
             if (CI && CI->getCalledFunction() && CI->getCalledFunction() == MetasetFunc) {
                 Instruction *ptrToInt = dyn_cast<Instruction>(CI->getArgOperand(0));
+                if (!ptrToInt)
+                    continue;
                 AllocaInst *AI = dyn_cast<AllocaInst>(ptrToInt->getOperand(0));
-                if (rootUseCount[AI] > 0) {
+                if (AI && rootUseCount[AI] > 0) {
                     rootInfo[AI] = CI;
                 }
             }
@@ -277,6 +293,223 @@ struct DummyPass : public FunctionPass {
         }
     }
 
+    // metaget_base only exists for page-table lookups of up to 8 bytes
+    bool CanCacheMetabase() {
+        if (!MetabaseCaching || FixedCompression)
+            return false;
+        if (DeepMetadata)
+            return DeepMetadataBytes == 8;
+        return MetadataBytes <= 8;
+    }
+
+    void ProcessRoots(Function *F, DominatorTree *DT) {
+        rootInfo.clear();
+        rootUseCount.clear();
+        sideEffectRoot.clear();
+        unsafeSideEffects.clear();
+
+        SM->AccumulateUnsafeSideEffects(F, unsafeSideEffects);
+        MapRootUses(F, DT);
+
+        ProcessPointerArgs(F);
+        ProcessGlobals(F);
+        ProcessPointerReads(F);
+        ProcessUnsafeStack(F);
+    }
+
+    // Get the metabase of the root a store is derived from, if it is
+    // available at the store
+    Value *GetRootMetabase(StoreInst *SI, DominatorTree *DT, Value **root) {
+        auto sideEffect = sideEffectRoot.find(SI);
+        if (sideEffect == sideEffectRoot.end() || sideEffect->second == NULL)
+            return NULL;
+        auto info = rootInfo.find(sideEffect->second);
+        if (info == rootInfo.end())
+            return NULL;
+        // Metaset calls for the stack may come after the store
+        Instruction *metabase = dyn_cast<Instruction>(info->second);
+        if (metabase && !DT->dominates(metabase, SI))
+            return NULL;
+        *root = const_cast<Value*>(sideEffect->second);
+        return info->second;
+    }
+
+    Value *GetCheckedPointer(StoreInst *SI, const std::set<const Instruction*> &ignoredStores) {
+        if (ignoredStores.count(SI) || ignoredGlobalStores.count(SI))
+            return NULL;
+        if (OnlyPointerWrites && !SI->getValueOperand()->getType()->isPointerTy())
+            return NULL;
+        return SI->getPointerOperand();
+    }
+
+    // Get the base object of a store and the index of the metadata granule
+    // it writes to, relative to that base. Every allocator aligns objects to
+    // at least GLOBALALIGN, so the granule is only known if the base is
+    // aligned to that as well and the store does not straddle two granules.
+    const Value *GetStoreGranule(StoreInst *SI, Value *ptr, int64_t *granule) {
+        int64_t offset = 0;
+        Value *base = GetPointerBaseWithConstantOffset(ptr, offset, *DL);
+
+        unsigned bits = DL->getPointerTypeSizeInBits(base->getType());
+        APInt knownZero(bits, 0), knownOne(bits, 0);
+        computeKnownBits(base, knownZero, knownOne, *DL);
+        if (knownZero.countTrailingOnes() < GLOBALALIGN)
+            return NULL;
+
+        int64_t granuleSize = 1LL << GLOBALALIGN;
+        int64_t size = DL->getTypeStoreSize(SI->getValueOperand()->getType());
+        int64_t first = offset >= 0 ? offset / granuleSize : -((-offset + granuleSize - 1) / granuleSize);
+        int64_t last = first + (offset - first * granuleSize + size - 1) / granuleSize;
+        if (first != last)
+            return NULL;
+
+        *granule = first;
+        return base;
+    }
+
+    // Metadata functions that only read metadata (lookups and checks) or
+    // wrap libc functions. Others, like metaset_* and unsafe_stack_free_meta,
+    // change the metadata a check has seen.
+    bool IsMetadataReader(const Function *F) {
+        StringRef name = F->getName();
+        if (!ISMETADATAFUNC(name.str().c_str()))
+            return false;
+        return name.startswith("metaget") || name.startswith("metabaseget") ||
+            name.startswith("metacheck") || name.startswith("boundscheck") ||
+            name.startswith("midfat_") || name == "meta_report_stats";
+    }
+
+    // Find stores in a basic block that write to the same metadata granule
+    // of an object as an earlier checked store. Calls may free or reallocate
+    // the object, so no check is reused across them, except those of
+    // metadata readers.
+    void CoalesceStoreChecks(BasicBlock &BB, const std::set<const Instruction*> &ignoredStores,
+            std::set<const StoreInst*> &coalesced) {
+        std::set<std::pair<const Value*, int64_t> > checked;
+
+        for (auto &i : BB) {
+            if (isa<CallInst>(&i) || isa<InvokeInst>(&i)) {
+                ImmutableCallSite CS(&i);
+                const Function *callee = CS.getCalledFunction();
+                if (isa<DbgInfoIntrinsic>(&i) || (callee && IsMetadataReader(callee)))
+                    continue;
+                checked.clear();
+                continue;
+            }
+
+            StoreInst *SI = dyn_cast<StoreInst>(&i);
+            if (!SI)
+                continue;
+            Value *ptr = GetCheckedPointer(SI, ignoredStores);
+            if (!ptr)
+                continue;
+
+            int64_t granule;
+            const Value *base = GetStoreGranule(SI, ptr, &granule);
+            if (base && !checked.insert(std::make_pair(base, granule)).second)
+                coalesced.insert(SI);
+        }
+    }
+
+    // metacheck_range only exists for page-table lookups of up to 8 bytes
+    bool CanHoistLoopChecks() {
+        return HoistLoopChecks && !FixedCompression && !DeepMetadata && MetadataBytes <= 8;
+    }
+
+    // Calls may free the stored-to object or leave the loop early, so only
+    // loops without them get their checks hoisted
+    bool HasCalls(Loop *L) {
+        for (BasicBlock *BB : L->blocks()) {
+            for (auto &i : *BB) {
+                if (!isa<CallInst>(&i) && !isa<InvokeInst>(&i))
+                    continue;
+                ImmutableCallSite CS(&i);
+                const Function *callee = CS.getCalledFunction();
+                if (isa<DbgInfoIntrinsic>(&i) || (callee && IsMetadataReader(callee)))
+                    continue;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Check if a store in a loop writes to an affine address on every
+    // iteration of a loop with a computable trip count, and if so get the
+    // byte range it writes over all iterations
+    bool GetLoopStoreRange(StoreInst *SI, Value *ptr, Loop *L, DominatorTree *DT,
+            ScalarEvolution *SE, const SCEV **lo, const SCEV **hi) {
+        // Without early exits, the store runs exactly once per iteration
+        if (!L->getLoopPreheader() || !L->getLoopLatch() ||
+                L->getExitingBlock() != L->getLoopLatch() ||
+                !DT->dominates(SI->getParent(), L->getLoopLatch()))
+            return false;
+
+        const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(ptr));
+        if (!AR || AR->getLoop() != L || !AR->isAffine())
+            return false;
+        const SCEVConstant *step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(*SE));
+        if (!step)
+            return false;
+
+        const SCEV *BTC = SE->getBackedgeTakenCount(L);
+        if (isa<SCEVCouldNotCompute>(BTC))
+            return false;
+
+        const SCEV *first = AR->getStart();
+        const SCEV *last = AR->evaluateAtIteration(BTC, *SE);
+        uint64_t size = DL->getTypeStoreSize(SI->getValueOperand()->getType());
+        Type *Ty = SE->getEffectiveSCEVType(AR->getType());
+        if (step->getValue()->isNegative())
+            std::swap(first, last);
+        *lo = first;
+        *hi = SE->getAddExpr(last, SE->getConstant(Ty, size));
+
+        return isSafeToExpand(*lo, *SE) && isSafeToExpand(*hi, *SE);
+    }
+
+    // Replace the per-iteration checks of stores in loops by a single range
+    // check in the preheader. Stores in other loops keep their checks.
+    void HoistStoreChecks(Function &F, const std::set<const Instruction*> &ignoredStores,
+            LoopInfo *LI, DominatorTree *DT, ScalarEvolution *SE,
+            std::set<const StoreInst*> &hoisted) {
+        std::map<Loop*, bool> loopHasCalls;
+        std::set<std::pair<const SCEV*, const SCEV*> > emitted;
+        SCEVExpander Expander(*SE, *DL, "metarange");
+
+        for (auto &i : instructions(F)) {
+            StoreInst *SI = dyn_cast<StoreInst>(&i);
+            if (!SI)
+                continue;
+            Loop *L = LI->getLoopFor(SI->getParent());
+            if (!L)
+                continue;
+            Value *ptr = GetCheckedPointer(SI, ignoredStores);
+            if (!ptr)
+                continue;
+
+            if (!loopHasCalls.count(L))
+                loopHasCalls[L] = HasCalls(L);
+            if (loopHasCalls[L])
+                continue;
+
+            const SCEV *lo, *hi;
+            if (!GetLoopStoreRange(SI, ptr, L, DT, SE, &lo, &hi))
+                continue;
+
+            hoisted.insert(SI);
+            if (!emitted.insert(std::make_pair(lo, hi)).second)
+                continue;
+
+            Instruction *insertPt = L->getLoopPreheader()->getTerminator();
+            std::vector<Value *> callParams;
+            callParams.push_back(Expander.expandCodeFor(lo, IntPtrTy, insertPt));
+            callParams.push_back(Expander.expandCodeFor(hi, IntPtrTy, insertPt));
+            callParams.push_back(ConstantInt::get(IntMetaTy, 0));
+            CallInst::Create(MetacheckRangeFunc, callParams, "", insertPt);
+            rangeChecks++;
+        }
+    }
+
     virtual bool runOnFunction(Function &F) {
         if (!initialized)
             doInitialization(F.getParent());
@@ -284,11 +517,22 @@ struct DummyPass : public FunctionPass {
         if (ISMETADATAFUNC(F.getName().str().c_str()))
             return false;
 
-        SM = new SafetyManager(DL, &getAnalysis<ScalarEvolutionWrapperPass>().getSE());
+        SM = new SafetyManager(DL, &getAnalysis<ScalarEvolutionWrapperPass>().getSE(), &Summaries);
 
         std::set<const Instruction*> ignoredStores;
         SM->AccumulateSafeSideEffects(&F, ignoredStores);
 
+        DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+        bool cacheMetabase = CanCacheMetabase();
+        if (cacheMetabase)
+            ProcessRoots(&F, DT);
+
+        std::set<const StoreInst*> hoisted;
+        if (CanHoistLoopChecks()) {
+            LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+            HoistStoreChecks(F, ignoredStores, LI, DT, SM->SE, hoisted);
+        }
+
         for (auto &bb : F) {
             for (auto &i : bb) {
                 Instruction *ins = &i;
@@ -302,6 +546,9 @@ struct DummyPass : public FunctionPass {
                         ignoredGlobalStores.insert(SI);
                 }
             }
+            std::set<const StoreInst*> coalesced;
+            if (CoalesceChecks)
+                CoalesceStoreChecks(bb, ignoredStores, coalesced);
             for (auto &i : bb) {
                 Instruction *ins = &i;
                 StoreInst *SI = dyn_cast<StoreInst>(ins);
@@ -320,22 +567,38 @@ struct DummyPass : public FunctionPass {
                     if (!OnlyPointerWrites) {
                         ptr = SI->getPointerOperand();
                     }
-                    if (ptr) {
+                    if (ptr && hoisted.count(SI)) {
+                            rangeChecked++;
+                    } else if (ptr && coalesced.count(SI)) {
+                            merged++;
+                    } else if (ptr) {
                             Value *ptrInt = B.CreatePtrToInt(ptr, IntPtrTy);
+                            Value *root = NULL;
+                            Value *metabase = cacheMetabase ? GetRootMetabase(SI, DT, &root) : NULL;
                             std::vector<Value *> callParams;
                             callParams.push_back(ptrInt);
-                            Value *meta = B.CreateCall(MetagetFunc, callParams);
+                            Value *meta;
+                            if (metabase) {
+                                callParams.push_back(metabase);
+                                callParams.push_back(B.CreatePtrToInt(root, IntPtrTy));
+                                meta = B.CreateCall(MetagetWithBaseFunc, callParams);
+                                optimized++;
+                            } else {
+                                meta = B.CreateCall(MetagetFunc, callParams);
+                                unoptimized++;
+                            }
                             callParams.clear();
                             callParams.push_back(meta);
                             callParams.push_back(ConstantInt::get(IntMetaTy, 0));
                             B.CreateCall(MetacheckFunc, callParams);
-                            unoptimized++;
                     }
                 } else if (SI) untracked++;
             }
         }
 
-        DEBUG(errs() << "Tracked: " << tracked << "  Untracked: " << untracked << "\n");
+        DEBUG(errs() << "Tracked: " << tracked << "  Untracked: " << untracked <<
+                "  Optimized: " << optimized << "  Unoptimized: " << unoptimized << "  Merged: " << merged <<
+                "  Range checked: " << rangeChecked << " (" << rangeChecks << " checks)\n");
 
         delete SM;
 
@@ -385,6 +648,9 @@ struct DummyPass : public FunctionPass {
         else
             functionName = "metacheck_" + std::to_string(MetadataBytes);
         MetacheckFunc = M->getOrInsertFunction(functionName, VoidTy, IntMetaTy, IntMetaTy, NULL);
+        //declare void @metacheck_range(i64, i64, iM)
+        functionName = "metacheck_range_" + std::to_string(MetadataBytes);
+        MetacheckRangeFunc = M->getOrInsertFunction(functionName, VoidTy, IntPtrTy, IntPtrTy, IntMetaTy, NULL);
         //declare i64 @metaset_alignment(i64, i64, iM, i64)
         if (!FixedCompression) {
             functionName = "metaset_alignment_" + std::to_string(MetadataBytes);
@@ -396,7 +662,10 @@ struct DummyPass : public FunctionPass {
                 IntPtrTy, IntPtrTy, IntMetaTy, NULL);
         }
 
-        SM = new SafetyManager(DL, &getAnalysis<ScalarEvolutionWrapperPass>().getSE());
+        if (UseSafetySummaries)
+            Summaries.compute(*M);
+
+        SM = new SafetyManager(DL, &getAnalysis<ScalarEvolutionWrapperPass>().getSE(), &Summaries);
 
         SM->AccumulateSafeSideEffects(M, ignoredGlobalStores);
         SM->AccumulateUnsafeSideEffects(M, unsafeGlobalSideEffects);
@@ -411,6 +680,7 @@ struct DummyPass : public FunctionPass {
     void getAnalysisUsage(AnalysisUsage &AU) const override {
         AU.addRequired<ScalarEvolutionWrapperPass>();
         AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<LoopInfoWrapperPass>();
     }
 
 };
@@ -0,0 +1,132 @@
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/LineIterator.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <algorithm>
+#include <tuple>
+
+#include "ExtFuncModel.h"
+
+#define DEBUG_TYPE "ext-func-model"
+
+using namespace llvm;
+
+static cl::opt<std::string> ModelFile("ext-func-model",
+        cl::desc("File describing which arguments of external functions to mask"),
+        cl::init(""));
+
+bool ExtFuncModel::Entry::masks(unsigned ArgNo) const {
+    return MaskAll ||
+        std::find(MaskArgs.begin(), MaskArgs.end(), ArgNo) != MaskArgs.end();
+}
+
+void ExtFuncModel::addDefaults() {
+    static const char *Wrappers[] = {
+        "_E__pr_info", /* sphinx3 vfprintf wrapper */
+        "_ZN12pov_frontend13MessageOutput6PrintfEiPKcz", /* povray vsnprintf wrapper */
+        "_ZN8pov_base16TextStreamBuffer6printfEPKcz", /* povray vsnprintf wrapper */
+        "_ZN3pov10Debug_InfoEPKcz", /* povray vsnprintf wrapper */
+        "_ZN6cEnvir9printfmsgEPKcz" /* omnetpp vsprintf wrapper */
+    };
+    for (const char *Name : Wrappers)
+        Entries[Name].Wrapper = true;
+
+    /* inlined std::list::push_back */
+    Entries["_ZNSt8__detail15_List_node_base7_M_hookEPS0_"].NestedArgs = {1};
+    /* inlined std::string += std::string */
+    Entries["_ZNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEE9_M_appendEPKcm"].NestedArgs = {0};
+}
+
+static std::vector<unsigned> parseArgList(StringRef List, unsigned LineNo) {
+    SmallVector<StringRef, 4> Fields;
+    std::vector<unsigned> Args;
+    unsigned ArgNo;
+
+    SplitString(List, Fields, ",");
+    for (StringRef Field : Fields) {
+        if (Field.getAsInteger(10, ArgNo))
+            report_fatal_error("ext-func-model:" + Twine(LineNo) +
+                    ": invalid argument number '" + Field + "'");
+        Args.push_back(ArgNo);
+    }
+    return Args;
+}
+
+void ExtFuncModel::parseLine(StringRef Line, unsigned LineNo) {
+    SmallVector<StringRef, 8> Fields;
+    SplitString(Line, Fields, " \t");
+    if (Fields.empty())
+        return;
+
+    /* Start from the defaults, so that a file entry for a wrapper or
+     * libstdc++ function only needs to list what it changes */
+    Entry &E = Entries[Fields[0].str()];
+
+    for (unsigned i = 1; i < Fields.size(); i++) {
+        StringRef Key, Value;
+        std::tie(Key, Value) = Fields[i].split('=');
+
+        if (Key == "mask") {
+            E.MaskAll = Value == "all";
+            E.MaskArgs.clear();
+            if (!E.MaskAll && Value != "none")
+                E.MaskArgs = parseArgList(Value, LineNo);
+        }
+        else if (Key == "ret") {
+            if (Value == "thin") {
+                E.Ret = RetThin;
+            }
+            else if (Value.startswith("arg") &&
+                    !Value.drop_front(3).getAsInteger(10, E.RetArgNo)) {
+                E.Ret = RetArg;
+            }
+            else {
+                report_fatal_error("ext-func-model:" + Twine(LineNo) +
+                        ": invalid return value '" + Value + "'");
+            }
+        }
+        else if (Key == "nested") {
+            E.NestedArgs = parseArgList(Value, LineNo);
+        }
+        else if (Key == "wrapper" && Value.empty()) {
+            E.Wrapper = true;
+        }
+        else if (Key == "shim" && !Value.empty()) {
+            E.Shim = Value;
+        }
+        else {
+            report_fatal_error("ext-func-model:" + Twine(LineNo) +
+                    ": unknown property '" + Fields[i] + "'");
+        }
+    }
+}
+
+void ExtFuncModel::load() {
+    Entries.clear();
+    addDefaults();
+
+    if (ModelFile.empty())
+        return;
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(ModelFile);
+    if (std::error_code EC = Buf.getError())
+        report_fatal_error("ext-func-model: cannot read " + ModelFile + ": " + EC.message());
+
+    for (line_iterator It(**Buf, true, '#'); !It.is_at_end(); ++It)
+        parseLine(*It, It.line_number());
+
+    DEBUG(dbgs() << "ExtFuncModel: " << Entries.size() << " functions modeled\n");
+}
+
+const ExtFuncModel::Entry *ExtFuncModel::get(StringRef Name) const {
+    auto it = Entries.find(Name.str());
+    return it == Entries.end() ? nullptr : &it->second;
+}
+
+const ExtFuncModel::Entry *ExtFuncModel::get(const Function *F) const {
+    return F ? get(F->getName()) : nullptr;
+}
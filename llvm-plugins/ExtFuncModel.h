@@ -0,0 +1,63 @@
+#ifndef EXT_FUNC_MODEL_H
+#define EXT_FUNC_MODEL_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Function.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Model of functions whose code is not instrumented (libc, libstdc++), loaded
+ * from the file given with -ext-func-model. Each line names a function and
+ * describes it with a list of properties:
+ *
+ *   mask=all|none|<i>,...  pointer arguments that must be masked before the
+ *                          call (default: all)
+ *   ret=thin|arg<i>        the returned pointer never carries metadata, or is
+ *                          derived from argument <i>
+ *   nested=<i>,...         arguments pointing to structs whose pointer fields
+ *                          must be masked before the call
+ *   wrapper                the function is defined in the program but passes
+ *                          its arguments on to an external function (e.g., a
+ *                          vfprintf wrapper), so its arguments are masked too
+ *   shim=<name>            redirect calls to a fat-pointer tolerant
+ *                          replacement in the static library
+ *
+ * Functions without an entry have all their pointer arguments masked and
+ * may return fat pointers. Some SPEC wrappers and libstdc++ functions are
+ * always modeled, the file adds to and overrides them.
+ */
+class ExtFuncModel {
+public:
+    enum RetKind {
+        RetUnknown,
+        RetThin,
+        RetArg
+    };
+
+    struct Entry {
+        bool MaskAll = true;
+        std::vector<unsigned> MaskArgs;
+        RetKind Ret = RetUnknown;
+        unsigned RetArgNo = 0;
+        std::vector<unsigned> NestedArgs;
+        bool Wrapper = false;
+        std::string Shim;
+
+        bool masks(unsigned ArgNo) const;
+    };
+
+    void load();
+    const Entry *get(const llvm::Function *F) const;
+    const Entry *get(llvm::StringRef Name) const;
+
+private:
+    std::map<std::string, Entry> Entries;
+
+    void addDefaults();
+    void parseLine(llvm::StringRef Line, unsigned LineNo);
+};
+
+#endif /* !EXT_FUNC_MODEL_H */
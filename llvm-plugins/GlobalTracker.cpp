@@ -32,6 +32,10 @@
 
 using namespace llvm;
 
+static cl::opt<bool> StaticGlobals("globaltracker-static",
+        cl::desc("Emit global metadata as records in the midfat_globalmeta section instead of metaset calls"),
+        cl::init(false));
+
 struct GlobalTracker : public ModulePass {
     static char ID;
     bool initialized;
@@ -46,6 +50,8 @@ struct GlobalTracker : public ModulePass {
     PointerType *PtrVoidTy;
 
     StructType *MetaDataTy;
+    //struct { i64 ptr, i64 size, i64 metadata } in midfat_globalmeta
+    StructType *RecordTy;
 
     //declare i64 @metaset_alignment(i64, i64, iM, i64)
     Constant *MetasetFunc;
@@ -67,13 +73,27 @@ struct GlobalTracker : public ModulePass {
 
         std::set<Value*> metaDataInserted;
 
-	Instruction *globalInitReturn = getGlobalInitReturn();
-	if (!globalInitReturn)
-		report_fatal_error("error; either initialize_global_metadata "
-			"has no return instruction or you forgot to link in "
-			"libmetadata.a");
-
-        IRBuilder<> B(globalInitReturn);
+        /* Per module, initialize_global_metadata is in another module, so
+         * register the globals defined here in a module constructor */
+        bool perModule = !PerModulePasses.empty();
+        Function *moduleInitFunc = NULL;
+        IRBuilder<> B(M->getContext());
+        std::vector<Constant*> records;
+
+        if (!StaticGlobals) {
+            moduleInitFunc = perModule ? createModuleInit() : NULL;
+            Instruction *globalInitReturn = perModule ?
+                moduleInitFunc->getEntryBlock().getTerminator() :
+                getGlobalInitReturn();
+            if (!globalInitReturn)
+                report_fatal_error("error; either initialize_global_metadata "
+                        "has no return instruction or you forgot to link in "
+                        "libmetadata.a");
+            B.SetInsertPoint(globalInitReturn);
+        }
+        else if (DeepMetadata && MetadataBytes != 8) {
+            report_fatal_error("globaltracker-static requires 8-byte deep metadata pointers");
+        }
 
         for (auto& global: M->globals()) {
             GlobalValue *G = &global;
@@ -81,6 +101,9 @@ struct GlobalTracker : public ModulePass {
             if (metaDataInserted.count(G))
                 continue;
 
+            if (perModule && G->isDeclaration())
+                continue;
+
             if (G->getName() == "llvm.global_ctors" ||
 		G->getName() == "llvm.global_dtors" ||
 		G->getName() == "llvm.global.annotations" ||
@@ -93,7 +116,20 @@ struct GlobalTracker : public ModulePass {
                 dyn_cast<GlobalObject>(G)->setAlignment(8);
 
             unsigned long elementSize = DL->getTypeAllocSize(G->getType()->getPointerElementType());
-            Value *size = ConstantInt::get(IntPtrTy, elementSize);
+            Constant *size = ConstantInt::get(IntPtrTy, elementSize);
+
+            /* The runtime allocates zeroed metadata for the data sections,
+             * so only deep metadata pointers need to be recorded */
+            if (StaticGlobals) {
+                if (DeepMetadata) {
+                    GlobalVariable *metaData = createMetaData(G);
+                    metaDataInserted.insert(metaData);
+                    records.push_back(ConstantStruct::get(RecordTy, {
+                        ConstantExpr::getPtrToInt(G, IntPtrTy), size,
+                        ConstantExpr::getPtrToInt(metaData, IntPtrTy)}));
+                }
+                continue;
+            }
 
             Value *ptr = B.CreatePtrToInt(G, IntPtrTy);
             // Reset metadata when none is desired
@@ -109,15 +145,8 @@ struct GlobalTracker : public ModulePass {
                 B.CreateCall(MetasetFunc, callParams);
            } else {
                 // Create and initialize the metadata object
-                GlobalVariable *metaData = new GlobalVariable(*M, MetaDataTy, false,
-                                    GlobalVariable::LinkageTypes::InternalLinkage,
-                                    nullptr, "MetaData_" + G->getName());
+                GlobalVariable *metaData = createMetaData(G);
                 metaDataInserted.insert(metaData);
-                std::vector<Constant *> globalMembers;
-                for (unsigned long i = 0; i < (DeepMetadataBytes / sizeof(unsigned long)); ++i)
-                    globalMembers.push_back(ConstantInt::get(IntPtrTy, 0, 0));
-                Constant *globalInitializer = ConstantStruct::get(MetaDataTy, globalMembers);
-                metaData->setInitializer(globalInitializer);
                 // Set desired metadata
                 // Uses metaset
                 std::vector<Value *> callParams;
@@ -130,7 +159,64 @@ struct GlobalTracker : public ModulePass {
                 B.CreateCall(MetasetFunc, callParams);
            }
         }
-        return false;
+
+        /* Run after initialize_global_metadata (in .preinit_array) has reset
+         * the metadata of the data sections */
+        if (moduleInitFunc)
+            appendToGlobalCtors(*M, moduleInitFunc, 0);
+
+        /* The linker concatenates the records of all modules, which
+         * initialize_global_metadata applies between __start_midfat_globalmeta
+         * and __stop_midfat_globalmeta */
+        if (!records.empty()) {
+            ArrayType *RecordsTy = ArrayType::get(RecordTy, records.size());
+            GlobalVariable *Records = new GlobalVariable(*M, RecordsTy, false,
+                    GlobalVariable::LinkageTypes::InternalLinkage,
+                    ConstantArray::get(RecordsTy, records), "midfat_globalmeta_records");
+            Records->setSection("midfat_globalmeta");
+            Records->setAlignment(8);
+            addToUsed(Records);
+        }
+
+        return true;
+    }
+
+    GlobalVariable *createMetaData(GlobalValue *G) {
+        GlobalVariable *metaData = new GlobalVariable(*M, MetaDataTy, false,
+                            GlobalVariable::LinkageTypes::InternalLinkage,
+                            nullptr, "MetaData_" + G->getName());
+        std::vector<Constant *> globalMembers;
+        for (unsigned long i = 0; i < (DeepMetadataBytes / sizeof(unsigned long)); ++i)
+            globalMembers.push_back(ConstantInt::get(IntPtrTy, 0, 0));
+        Constant *globalInitializer = ConstantStruct::get(MetaDataTy, globalMembers);
+        metaData->setInitializer(globalInitializer);
+        return metaData;
+    }
+
+    /* Keep the records alive although nothing references them in the IR */
+    void addToUsed(GlobalValue *GV) {
+        std::vector<Constant*> used;
+        if (GlobalVariable *Used = M->getGlobalVariable("llvm.used")) {
+            if (ConstantArray *Init = dyn_cast<ConstantArray>(Used->getInitializer())) {
+                for (Use &Op : Init->operands())
+                    used.push_back(cast<Constant>(Op.get()));
+            }
+            Used->eraseFromParent();
+        }
+        used.push_back(ConstantExpr::getPointerBitCastOrAddrSpaceCast(GV, PtrVoidTy));
+        ArrayType *UsedTy = ArrayType::get(PtrVoidTy, used.size());
+        GlobalVariable *Used = new GlobalVariable(*M, UsedTy, false,
+                GlobalValue::AppendingLinkage, ConstantArray::get(UsedTy, used), "llvm.used");
+        Used->setSection("llvm.metadata");
+    }
+
+    Function *createModuleInit() {
+        FunctionType *FnTy = FunctionType::get(VoidTy, false);
+        Function *F = Function::Create(FnTy, GlobalValue::InternalLinkage,
+                "initialize_module_global_metadata", M);
+        BasicBlock *BB = BasicBlock::Create(M->getContext(), "entry", F);
+        ReturnInst::Create(M->getContext(), BB);
+        return F;
     }
 
     bool doInitialization(Module *Mod) {
@@ -153,6 +239,7 @@ struct GlobalTracker : public ModulePass {
         for (unsigned long i = 0; i < (DeepMetadataBytes / sizeof(unsigned long)); ++i)
             MetaMembers.push_back(IntPtrTy);
         MetaDataTy = StructType::create(M->getContext(), MetaMembers);
+        RecordTy = StructType::get(IntPtrTy, IntPtrTy, IntPtrTy, NULL);
 
         if (!FixedCompression) {
             //declare i64 @metaset(i64, i64, iM, i64)
@@ -166,7 +253,8 @@ struct GlobalTracker : public ModulePass {
                 IntPtrTy, IntPtrTy, IntMetaTy, NULL);
         }
         //declare void @initialize_global_metadata()
-        GlobalInitFunc = (Function*)M->getOrInsertFunction("initialize_global_metadata", VoidTy, NULL);
+        if (PerModulePasses.empty())
+            GlobalInitFunc = (Function*)M->getOrInsertFunction("initialize_global_metadata", VoidTy, NULL);
 
         initialized = true;
 
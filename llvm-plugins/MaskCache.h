@@ -0,0 +1,333 @@
+#ifndef MASK_CACHE_H
+#define MASK_CACHE_H
+
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/ConstantRange.h>
+#include <llvm/ADT/DepthFirstIterator.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpander.h>
+#include <llvm/Analysis/ValueTracking.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "Utils.h"
+#include <metadata.h>
+
+namespace llvm {
+
+typedef Value *(*maskfn_t)(Value *Ptr, IRBuilder<> &B);
+
+/*
+ * Dominator-tree based CSE of pointer masks. A pointer is masked at its first
+ * access and the masked value is reused by every access that it dominates.
+ * Pointers at a constant offset from a base pointer (GEPs, bitcasts) are
+ * rebuilt on the masked base instead of being masked separately. This yields
+ * the same address unless the offset carries past bit PTR_BITS, in which case
+ * the rebuilt pointer lies up to the offset above 2^PTR_BITS instead of
+ * wrapping around within the reduced address space. Offsets are therefore
+ * limited to the guard page that shrinkaddrspace reserves PROT_NONE right
+ * above the reduced address space, so that such a pointer faults (or lies
+ * below zero, in the kernel half, for negative offsets). With PTR_BITS=46 the
+ * meta-pagetable starts at 2^46 and there is no guard, so every access is
+ * masked separately. Anything else is masked per access as well.
+ *
+ * When loop info and scalar evolution are available, masks of loop-invariant
+ * pointers are hoisted into the preheader of the outermost loop they are
+ * invariant in. Indexed accesses such as base[i] with a loop-invariant base
+ * are then rebuilt on the hoisted mask of the base, provided SCEV proves that
+ * the index offset stays within the guard page for all iterations. Larger
+ * affine offsets that are accessed on every iteration of a loop without calls
+ * get a check in the loop's preheader that base + offset has the high bits of
+ * base for the first and last iteration, so that the offset cannot carry. If
+ * it does, the program would access memory outside of the reduced address
+ * space, and the rebuilt base gets bit 63 set so that the accesses fault, as
+ * the hoisted range checks of DummyPass and BoundsChecks trap early.
+ */
+class MaskCache {
+public:
+    unsigned Accesses = 0;
+    unsigned Inserted = 0;
+    unsigned Reused = 0;
+    unsigned Derived = 0;
+    unsigned Indexed = 0;
+    unsigned CarryChecked = 0;
+    unsigned Hoisted = 0;
+
+    MaskCache(DominatorTree &DT, const DataLayout &DL, maskfn_t MaskFn,
+            LoopInfo *LI = nullptr, ScalarEvolution *SE = nullptr) :
+        DT(DT), DL(DL), MaskFn(MaskFn), LI(LI), SE(SE) {}
+
+    /*
+     * Get a masked version of Ptr that is available at InsertBefore,
+     * inserting a new mask there if no dominating one exists.
+     */
+    Value *getMasked(Value *Ptr, Instruction *InsertBefore) {
+        IRBuilder<> B(InsertBefore);
+        Accesses++;
+
+        if (!MaskCSE) {
+            Inserted++;
+            return MaskFn(Ptr, B);
+        }
+
+        if (Value *Masked = findDominating(Ptr, InsertBefore)) {
+            Reused++;
+            return Masked;
+        }
+
+        int64_t Offset = 0;
+        Value *Base = GetPointerBaseWithConstantOffset(Ptr, Offset, DL);
+        if (Base != Ptr && isDerivableOffset(Offset)) {
+            /* Mask the base rather than Ptr itself, so that other pointers
+             * derived from it can reuse the mask as well */
+            Value *MaskedBase = getMaskedBase(Base, InsertBefore);
+            Value *Masked = deriveFrom(MaskedBase, Offset, Ptr->getType(), B);
+            Masks[Ptr].push_back(Masked);
+            Derived++;
+            return Masked;
+        }
+
+        if (Value *Masked = getMaskedIndexed(Ptr, InsertBefore))
+            return Masked;
+
+        return insertMask(Ptr, InsertBefore);
+    }
+
+    /*
+     * Order instructions such that dominating blocks come before the blocks
+     * they dominate, so that masks are inserted at the first access.
+     * Instructions within a block keep their relative order.
+     */
+    void sortByDominance(std::vector<Instruction*> &Ins) {
+        std::map<const BasicBlock*, unsigned> Order;
+        unsigned N = 0;
+        for (DomTreeNode *Node : depth_first(DT.getRootNode()))
+            Order[Node->getBlock()] = N++;
+
+        std::stable_sort(Ins.begin(), Ins.end(),
+                [&Order, N](Instruction *A, Instruction *B) {
+            auto ItA = Order.find(A->getParent());
+            auto ItB = Order.find(B->getParent());
+            unsigned OrderA = ItA == Order.end() ? N : ItA->second;
+            unsigned OrderB = ItB == Order.end() ? N : ItB->second;
+            return OrderA < OrderB;
+        });
+    }
+
+    /* Number of masks saved compared to masking every access separately */
+    unsigned removed() const {
+        return Accesses - Inserted;
+    }
+
+private:
+    DominatorTree &DT;
+    const DataLayout &DL;
+    maskfn_t MaskFn;
+    LoopInfo *LI;
+    ScalarEvolution *SE;
+    std::map<Value*, std::vector<Value*>> Masks;
+    std::map<Loop*, bool> LoopHasCalls;
+
+    /*
+     * Insert masks of loop-invariant values in the preheader of the
+     * outermost loop they are invariant in, or right before I otherwise.
+     */
+    Instruction *getMaskInsertPoint(Value *V, Instruction *I) {
+        Instruction *InsertPt = I;
+        if (!LI)
+            return InsertPt;
+
+        for (Loop *L = LI->getLoopFor(I->getParent()); L; L = L->getParentLoop()) {
+            BasicBlock *Preheader = L->getLoopPreheader();
+            if (!Preheader || !L->isLoopInvariant(V))
+                break;
+            InsertPt = Preheader->getTerminator();
+        }
+        return InsertPt;
+    }
+
+    Value *insertMask(Value *V, Instruction *I) {
+        Instruction *InsertPt = getMaskInsertPoint(V, I);
+        if (InsertPt != I)
+            Hoisted++;
+
+        IRBuilder<> B(InsertPt);
+        Value *Masked = MaskFn(V, B);
+        Masks[V].push_back(Masked);
+        Inserted++;
+        return Masked;
+    }
+
+    Value *getMaskedBase(Value *Base, Instruction *I) {
+        if (Value *MaskedBase = findDominating(Base, I)) {
+            Reused++;
+            return MaskedBase;
+        }
+        return insertMask(Base, I);
+    }
+
+    /*
+     * Rebuild an indexed access with a loop-varying offset on the (hoisted)
+     * mask of its loop-invariant base, if the offset provably stays within
+     * the guard page or is checked not to carry before the loop. Returns null
+     * if this is not possible.
+     */
+    Value *getMaskedIndexed(Value *Ptr, Instruction *I) {
+        if (!LI || !SE)
+            return nullptr;
+
+        GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Ptr->stripPointerCasts());
+        if (!GEP)
+            return nullptr;
+
+        Value *Base = GEP->getPointerOperand();
+        Loop *L = LI->getLoopFor(I->getParent());
+        if (!L || !L->getLoopPreheader() || !L->isLoopInvariant(Base))
+            return nullptr;
+
+        if (!SE->isSCEVable(GEP->getType()) || !SE->isSCEVable(Base->getType()))
+            return nullptr;
+
+        const SCEV *Offset = SE->getMinusSCEV(SE->getSCEV(GEP), SE->getSCEV(Base));
+        if (isa<SCEVCouldNotCompute>(Offset))
+            return nullptr;
+
+        ConstantRange Range = SE->getSignedRange(Offset);
+        const SCEV *First = nullptr, *Last = nullptr;
+        if (Range.getBitWidth() > 64 ||
+                !isDerivableOffset(Range.getSignedMin().getSExtValue()) ||
+                !isDerivableOffset(Range.getSignedMax().getSExtValue())) {
+            if (!getOffsetRange(Offset, I, L, &First, &Last))
+                return nullptr;
+        }
+
+        Value *MaskedBase = getMaskedBase(Base, I);
+        if (First)
+            MaskedBase = checkNoCarry(Base, MaskedBase, First, Last, L);
+        Instruction *Clone = GEP->clone();
+        Clone->setOperand(GetElementPtrInst::getPointerOperandIndex(), MaskedBase);
+        Clone->setName("masked_idx");
+        Clone->insertBefore(I);
+
+        Value *Masked = Clone;
+        if (Clone->getType() != Ptr->getType())
+            Masked = new BitCastInst(Clone, Ptr->getType(), "derived", I);
+
+        Masks[Ptr].push_back(Masked);
+        Indexed++;
+        return Masked;
+    }
+
+    /* Calls may leave the loop early */
+    bool hasCalls(Loop *L) {
+        auto It = LoopHasCalls.find(L);
+        if (It != LoopHasCalls.end())
+            return It->second;
+
+        bool Calls = false;
+        for (BasicBlock *BB : L->blocks()) {
+            for (Instruction &I : *BB) {
+                if (!isa<CallInst>(&I) && !isa<InvokeInst>(&I))
+                    continue;
+                ImmutableCallSite CS(&I);
+                const Function *Callee = CS.getCalledFunction();
+                if (isa<DbgInfoIntrinsic>(&I) ||
+                        (Callee && ISMETADATAFUNC(Callee->getName().str().c_str())))
+                    continue;
+                Calls = true;
+            }
+        }
+        return LoopHasCalls[L] = Calls;
+    }
+
+    /*
+     * Get the offsets of the first and last iteration of an affine offset
+     * that I accesses on every iteration of L, like the hoisted range checks.
+     */
+    bool getOffsetRange(const SCEV *Offset, Instruction *I, Loop *L,
+            const SCEV **First, const SCEV **Last) {
+        if (!L->getLoopLatch() || L->getExitingBlock() != L->getLoopLatch() ||
+                !DT.dominates(I->getParent(), L->getLoopLatch()) || hasCalls(L))
+            return false;
+
+        const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(Offset);
+        if (!AR || AR->getLoop() != L || !AR->isAffine())
+            return false;
+
+        const SCEV *BTC = SE->getBackedgeTakenCount(L);
+        if (isa<SCEVCouldNotCompute>(BTC))
+            return false;
+
+        *First = AR->getStart();
+        *Last = AR->evaluateAtIteration(BTC, *SE);
+        return isSafeToExpand(*First, *SE) && isSafeToExpand(*Last, *SE);
+    }
+
+    /*
+     * In the preheader of L, check that Base + First and Base + Last keep the
+     * high bits of Base, and set bit 63 of the masked base if not.
+     */
+    Value *checkNoCarry(Value *Base, Value *MaskedBase, const SCEV *First,
+            const SCEV *Last, Loop *L) {
+        Instruction *InsertPt = L->getLoopPreheader()->getTerminator();
+        IRBuilder<> B(InsertPt);
+        Type *Int64Ty = B.getInt64Ty();
+        SCEVExpander Expander(*SE, DL, "maskrange");
+        Value *FirstV = Expander.expandCodeFor(First, Int64Ty, InsertPt);
+        Value *LastV = Expander.expandCodeFor(Last, Int64Ty, InsertPt);
+
+        Value *BaseInt = B.CreatePtrToInt(Base, Int64Ty, "base_int");
+        Value *High = B.CreateAnd(BaseInt, ~ptrMask(), "base_high");
+        Value *FirstHigh = B.CreateAnd(B.CreateAdd(BaseInt, FirstV), ~ptrMask());
+        Value *LastHigh = B.CreateAnd(B.CreateAdd(BaseInt, LastV), ~ptrMask());
+        Value *NoCarry = B.CreateAnd(B.CreateICmpEQ(FirstHigh, High),
+                B.CreateICmpEQ(LastHigh, High), "nocarry");
+
+        /* A reused mask may be derived within the loop */
+        Instruction *MaskedIns = dyn_cast<Instruction>(MaskedBase);
+        if (MaskedIns && !DT.dominates(MaskedIns, InsertPt)) {
+            MaskedBase = MaskFn(Base, B);
+            Inserted++;
+        }
+
+        Value *Fault = B.CreateShl(B.CreateZExt(B.CreateNot(NoCarry), Int64Ty), 63);
+        Value *MaskedInt = B.CreatePtrToInt(MaskedBase, Int64Ty);
+        CarryChecked++;
+        return B.CreateIntToPtr(B.CreateOr(MaskedInt, Fault),
+                MaskedBase->getType(), "checked_base");
+    }
+
+    Value *findDominating(Value *Ptr, Instruction *I) {
+        auto It = Masks.find(Ptr);
+        if (It == Masks.end())
+            return nullptr;
+
+        for (Value *Masked : It->second) {
+            /* masks of constants are folded into constants */
+            Instruction *MaskedIns = dyn_cast<Instruction>(Masked);
+            if (!MaskedIns || DT.dominates(MaskedIns, I))
+                return Masked;
+        }
+        return nullptr;
+    }
+
+    Value *deriveFrom(Value *MaskedBase, int64_t Offset, Type *Ty, IRBuilder<> &B) {
+        if (Offset == 0)
+            return B.CreateBitCast(MaskedBase, Ty, "derived");
+
+        unsigned AS = cast<PointerType>(MaskedBase->getType())->getAddressSpace();
+        Value *Bytes = B.CreateBitCast(MaskedBase, B.getInt8PtrTy(AS));
+        Value *GEP = B.CreateConstGEP1_64(Bytes, Offset);
+        return B.CreateBitCast(GEP, Ty, "derived");
+    }
+};
+
+}
+
+#endif /* !MASK_CACHE_H */
@@ -10,6 +10,9 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/CallSite.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
 
@@ -24,6 +27,10 @@
 
 #define DEBUG_TYPE "mask-pointers"
 
+#include "MaskCache.h"
+#include "Provenance.h"
+#include "ExtFuncModel.h"
+
 /*
  * TODO:
  *  - custom mem allocators
@@ -51,15 +58,20 @@ struct MaskPointers : public FunctionPass {
     static char ID;
 
     MaskPointers() : FunctionPass(ID) {}
+    bool doInitialization(Module &M) override;
     bool runOnFunction(Function &F) override;
+    void getAnalysisUsage(AnalysisUsage &AU) const override;
 
     void instrumentCallExt(CallSite *CS);
     void instrumentCallExtWrap(CallSite *CS);
     void instrumentCallByval(CallSite *CS);
     void instrumentCallExtNestedPtrs(CallSite *CS);
     void instrumentCmpPtr(CmpInst *CMP);
-    void instrumentMemAccess(Instruction *ins);
+    void instrumentMemAccess(Instruction *ins, MaskCache &MC);
     void instrumentPtrSub(Instruction *ins);
+
+    unsigned NumKnownObjectAccesses;
+    ExtFuncModel Model;
 };
 
 char MaskPointers::ID = 0;
@@ -68,16 +80,16 @@ static RegisterPass<MaskPointers> X("mask-pointers",
 
 static inline Value *maskPointer(Value *ptr, IRBuilder<> &B) {
     Value *asInt = B.CreatePtrToInt(ptr, B.getInt64Ty(), "as_int");
-    Value *masked = B.CreateAnd(asInt, PTR_MASK | OVERFLOW_MASK, "masked");
+    Value *masked = B.CreateAnd(asInt, ptrMask() | OVERFLOW_MASK, "masked");
     return B.CreateIntToPtr(masked, ptr->getType(), "as_ptr");
 }
 
-static void maskPointerArgs(CallSite *CS) {
+static void maskPointerArgs(CallSite *CS, const ExtFuncModel::Entry *E = nullptr) {
     IRBuilder<> B(CS->getInstruction());
 
     for (unsigned i = 0, n = CS->getNumArgOperands(); i < n; i++) {
         Value *arg = CS->getArgOperand(i);
-        if (arg->getType()->isPointerTy())
+        if (arg->getType()->isPointerTy() && (!E || E->masks(i)))
             CS->setArgument(i, maskPointer(arg, B));
     }
 }
@@ -101,7 +113,14 @@ void MaskPointers::instrumentCallExt(CallSite *CS) {
         F->getName().startswith("llvm.lifetime."))
         return;
 
-    maskPointerArgs(CS);
+    /* Modeled functions may only need some of their arguments masked, or
+     * have a replacement that accepts fat pointers */
+    const ExtFuncModel::Entry *E = Model.get(F);
+    if (E && !E->Shim.empty())
+        CS->setCalledFunction(F->getParent()->getOrInsertFunction(E->Shim,
+                    F->getFunctionType()));
+
+    maskPointerArgs(CS, E);
 }
 
 void MaskPointers::instrumentCallExtWrap(CallSite *CS) {
@@ -109,14 +128,11 @@ void MaskPointers::instrumentCallExtWrap(CallSite *CS) {
     if (CS->isInlineAsm() || !F)
         return;
 
-    if (F->getName() != "_E__pr_info" && /* sphinx3 vfprintf wrapper */
-        F->getName() != "_ZN12pov_frontend13MessageOutput6PrintfEiPKcz" && /* povray vsnprintf wrapper */
-        F->getName() != "_ZN8pov_base16TextStreamBuffer6printfEPKcz" && /* povray vsnprintf wrapper */
-        F->getName() != "_ZN3pov10Debug_InfoEPKcz" && /* povray vsnprintf wrapper */
-        F->getName() != "_ZN6cEnvir9printfmsgEPKcz") /* omnetpp vsprintf wrapper */
+    const ExtFuncModel::Entry *E = Model.get(F);
+    if (!E || !E->Wrapper)
         return;
 
-    maskPointerArgs(CS);
+    maskPointerArgs(CS, E);
 }
 
 void MaskPointers::instrumentCallByval(CallSite *CS) {
@@ -162,26 +178,18 @@ static void maskNestedPointers(Value *val, CompositeType *elTy,
 }
 
 void MaskPointers::instrumentCallExtNestedPtrs(CallSite *CS) {
-    static std::map<StringRef, std::vector<unsigned>> whitelist = {
-        /* inlined std::list::push_back */
-        {"_ZNSt8__detail15_List_node_base7_M_hookEPS0_", {1}},
-        /* inlined std::string += std::string */
-        {"_ZNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEE9_M_appendEPKcm", {0}}
-    };
-
     Function *F = CS->getCalledFunction();
     if (!F)
         return;
 
-    auto it = whitelist.find(F->getName());
-    if (it == whitelist.end())
+    const ExtFuncModel::Entry *E = Model.get(F);
+    if (!E || E->NestedArgs.empty() || !F->isDeclaration())
         return;
 
-    assert(F->isDeclaration());
     IRBuilder<> B(CS->getInstruction());
     std::vector<Value*> indices = {B.getInt64(0)};
 
-    for (unsigned i : it->second) {
+    for (unsigned i : E->NestedArgs) {
         Value *arg = CS->getArgOperand(i);
         Type *elTy = cast<PointerType>(arg->getType())->getElementType();
         assert(elTy->isAggregateType());
@@ -207,14 +215,21 @@ void MaskPointers::instrumentCmpPtr(CmpInst *ins) {
  * Mask out metadata bits in pointers when a pointer is accessed. It does not
  * mask out the overflow bit, so out-of-bound accesses will cause a fault.
  */
-void MaskPointers::instrumentMemAccess(Instruction *ins) {
+void MaskPointers::instrumentMemAccess(Instruction *ins, MaskCache &MC) {
     int ptrOperand = isa<StoreInst>(ins) ? 1 : 0;
     IRBuilder<> B(ins);
     Value *ptr = ins->getOperand(ptrOperand);
-    ins->setOperand(ptrOperand, maskPointer(ptr, B));
+    const DataLayout &DL = ins->getModule()->getDataLayout();
+    Type *accessTy = cast<PointerType>(ptr->getType())->getElementType();
+
+    /* In-bounds accesses to stack and global objects cannot escape the
+     * sandbox, so only mask the others */
+    if (isKnownObjectAccess(ptr, DL.getTypeStoreSize(accessTy), DL))
+        NumKnownObjectAccesses++;
+    else
+        ins->setOperand(ptrOperand, MC.getMasked(ptr, ins));
 
     /* Also mask writes of pointers to externs (e.g., environ). */
-    /* TODO: we don't have to mask the ptr above if global value */
     GlobalVariable *gv = dyn_cast<GlobalVariable>(ptr->stripPointerCasts());
     if (isa<StoreInst>(ins) && gv && !gv->hasInitializer() && gv->getType()->isPointerTy()) {
         ins->setOperand(0, maskPointer(ins->getOperand(0), B));
@@ -241,11 +256,23 @@ void MaskPointers::instrumentPtrSub(Instruction *ins) {
     //    << ":" << *ins << "\n";
 
     IRBuilder<> B(ins);
-    ins->setOperand(0, B.CreateAnd(a, PTR_MASK));
-    ins->setOperand(1, B.CreateAnd(b, PTR_MASK));
+    ins->setOperand(0, B.CreateAnd(a, ptrMask()));
+    ins->setOperand(1, B.CreateAnd(b, ptrMask()));
 }
 
 
+bool MaskPointers::doInitialization(Module &M) {
+    Model.load();
+    return false;
+}
+
+void MaskPointers::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.setPreservesCFG();
+}
+
 bool MaskPointers::runOnFunction(Function &F) {
     if (ISMETADATAFUNC(F.getName().str().c_str()))
         return false;
@@ -277,8 +304,23 @@ bool MaskPointers::runOnFunction(Function &F) {
         }
     }
 
+    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    MaskCache MC(DT, F.getParent()->getDataLayout(), maskPointer,
+            MaskHoist ? &LI : nullptr, MaskHoist ? &SE : nullptr);
+    MC.sortByDominance(mems);
+
+    NumKnownObjectAccesses = 0;
     for (Instruction *mem : mems)
-        instrumentMemAccess(mem);
+        instrumentMemAccess(mem, MC);
+
+    DEBUG(dbgs() << "MaskPointers: " << F.getName() << ": " <<
+            NumKnownObjectAccesses << " stack/global accesses not masked, " <<
+            MC.Accesses << " accesses, " << MC.Inserted << " masks inserted, " << MC.removed() <<
+            " removed (" << MC.Reused << " reused, " << MC.Derived << " derived, " <<
+            MC.Indexed << " indexed, " << MC.CarryChecked << " carry checked), " <<
+            MC.Hoisted << " hoisted\n");
 
     //DEBUG(errs() << "Function " << F.getName() << " after: " << F << "\n");
 
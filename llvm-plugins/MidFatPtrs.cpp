@@ -10,6 +10,12 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/CallSite.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
 
@@ -19,7 +25,7 @@
 #include <vector>
 #include <cassert>
 
-#include <metadata.h>            /* defines PTR_BITS */
+#include <metadata.h>
 #include <metapagetable_core.h>  /* defines pageTable */
 
 #define DEBUG_TYPE "MidFatPtrs"
@@ -27,11 +33,31 @@
 #include "Utils.h"
 #include "MetaPointerUtils.h"
 #include "PointerSink.h"
+#include "MaskCache.h"
+#include "PointerSplit.h"
+#include "Provenance.h"
+#include "ExtFuncModel.h"
 
 /* Disable certains steps of the pass for partial numbers/testing */
 
 using namespace llvm;
 
+static cl::opt<bool> MaskAddr32("midfat-addr32",
+        cl::desc("Mask pointers by truncating them to 32 bits, and compare pointers as 32-bit values"),
+        cl::init(false));
+
+static cl::opt<bool> UseProvenance("midfat-provenance",
+        cl::desc("Do not mask accesses through pointers that can never be fat"),
+        cl::init(true));
+
+static cl::opt<bool> ElideMetaPtrs("midfat-elide-metaptrs",
+        cl::desc("Leave allocations thin whose pointer never escapes the function or reaches a check"),
+        cl::init(true));
+
+static cl::opt<bool> SplitPointers("midfat-split",
+        cl::desc("Split fat pointers into address and metadata values within functions instead of masking accesses"),
+        cl::init(false));
+
 class MidFatPtrs : public ModulePass {
 public:
     static char ID;
@@ -41,22 +67,29 @@ public:
 private:
     Module *M;
     Function *LookupMetaPtrFunc;
+    GlobalVariable *NullDeepMetaPtr;
+    Provenance P;
+    ExtFuncModel Model;
+    std::set<const Instruction*> ThinAllocations;
+    unsigned NumAccesses[Provenance::PossiblyFat + 1] = {};
 
     bool runOnFunction(Function &F);
 
+    void findThinAllocations(Module &M);
     void instrumentCallAlloc(CallSite *CS);
     void instrumentCallExt(CallSite *CS);
     void instrumentCallExtWrap(CallSite *CS);
     void instrumentCallByval(CallSite *CS);
     void instrumentCallExtNestedPtrs(CallSite *CS);
     void instrumentCmpPtr(CmpInst *ins);
-    void instrumentMemAccess(Instruction *ins);
+    template <class MaskSource>
+    void instrumentMemAccess(Instruction *ins, MaskSource &MS);
     void instrumentSinks(sinklist_t &Sinks);
     void instrumentGlobals(Module &M);
 
     void putMetaPointerInHighBits(Instruction *Ptr);
     Value *buildMetaPointer(Value *Ptr, IRBuilder<> &B);
-    Value *buildFatPointer(Value *Ptr, Value *HighBits, IRBuilder<> &B);
+    Value *buildFatPointer(Value *Ptr, Value *MetaPtr, IRBuilder<> &B);
 };
 
 char MidFatPtrs::ID = 0;
@@ -95,13 +128,30 @@ static Instruction *getInsertPointAfter(Instruction *ins) {
     return std::next(BasicBlock::iterator(ins));
 }
 
+/*
+ * With 32-bit pointers, masking is a zero-extension of the low half. Emitting
+ * it as trunc+zext rather than an and makes the backend use a 32-bit register
+ * move (or fold it into a 32-bit operation) instead of a 64-bit immediate.
+ */
+static inline bool useAddr32() {
+    return MaskAddr32 && PtrBits == 32;
+}
+
+static inline Value *maskInt(Value *ptrInt, IRBuilder<> &B) {
+    if (useAddr32()) {
+        Value *low = B.CreateTrunc(ptrInt, B.getInt32Ty(), "low");
+        return B.CreateZExt(low, ptrInt->getType(), "masked");
+    }
+    return B.CreateAnd(ptrInt, ptrMask(), "masked");
+}
+
 static inline Value *maskPointer(Value *ptr, IRBuilder<> &B) {
     if (isPtrIntTy(ptr->getType()))
-        return B.CreateAnd(ptr, PTR_MASK, "masked");
+        return maskInt(ptr, B);
 
     assert(ptr->getType()->isPointerTy());
     Value *asInt = B.CreatePtrToInt(ptr, B.getInt64Ty(), "as_int");
-    Value *masked = B.CreateAnd(asInt, PTR_MASK, "masked");
+    Value *masked = maskInt(asInt, B);
     return B.CreateIntToPtr(masked, ptr->getType(), "as_ptr");
 }
 
@@ -110,8 +160,27 @@ Value *MidFatPtrs::buildMetaPointer(Value *Ptr, IRBuilder<> &B) {
     return B.CreateCall(LookupMetaPtrFunc, PtrInt, "metaptr");
 }
 
-Value *MidFatPtrs::buildFatPointer(Value *Ptr, Value *HighBits, IRBuilder<> &B) {
-    Value *Upper = B.CreateShl(HighBits, PTR_BITS, "highbits");
+/* Size of the metadata slots that lookup_metaptr returns */
+static inline unsigned long metaSlotSize() {
+    return DeepMetadata ? sizeof (unsigned long) : MetadataBytes;
+}
+
+/* Granularity of the high bits: metadata slots, or deep metadata objects */
+static inline unsigned long metaPtrAlign() {
+    return DeepMetadata ? DEEPMETA_ALIGN : MetadataBytes;
+}
+
+/*
+ * With more than 32 address bits, the high bits hold the offset of the
+ * metaptr from the metadata arena in slots instead (METAPTR_ENCODE).
+ */
+Value *MidFatPtrs::buildFatPointer(Value *Ptr, Value *MetaPtr, IRBuilder<> &B) {
+    Value *HighBits = MetaPtr;
+    if (PtrBits > 32) {
+        Value *Offset = B.CreateSub(MetaPtr, B.getInt64(METADATA_ARENA), "arenaoffset");
+        HighBits = B.CreateLShr(Offset, __builtin_ctzl(metaPtrAlign()), "slot");
+    }
+    Value *Upper = B.CreateShl(HighBits, PtrBits, "highbits");
     Value *LowBits = B.CreatePtrToInt(Ptr, B.getInt64Ty(), "lowbits");
     Value *Combined = B.CreateOr(LowBits, Upper, "combined");
     return B.CreateIntToPtr(Combined, Ptr->getType(), "fatptr");
@@ -119,6 +188,12 @@ Value *MidFatPtrs::buildFatPointer(Value *Ptr, Value *HighBits, IRBuilder<> &B)
 
 /*
  * Look up the meta pointer of a pointer and store it in its high bits.
+ *
+ * With deep metadata, the allocator has just stored the deep metadata object
+ * of the allocation in its metadata slot, so it is loaded here once and the
+ * high bits refer to the object itself: metaget_deep_* is then a single load.
+ * Failed allocations load a null object from NullDeepMetaPtr instead of
+ * reading the metadata slot of address zero.
  */
 void MidFatPtrs::putMetaPointerInHighBits(Instruction *Ptr) {
     assert(Ptr->getType()->isPointerTy());
@@ -126,9 +201,15 @@ void MidFatPtrs::putMetaPointerInHighBits(Instruction *Ptr) {
     /* Cache uses before creating more */
     std::vector<User*> Users(Ptr->user_begin(), Ptr->user_end());
 
-    /* Shift metaptr and put in high bits of allocated pointer */
+    /* Encode metaptr and put in high bits of allocated pointer */
     IRBuilder<> B(getInsertPointAfter(Ptr));
     Value *MetaPtr = buildMetaPointer(Ptr, B);
+    if (DeepMetadata) {
+        Value *SlotPtr = B.CreateIntToPtr(MetaPtr, B.getInt64Ty()->getPointerTo(), "deepptr_ptr");
+        Value *IsNull = B.CreateIsNull(Ptr, "isnull");
+        SlotPtr = B.CreateSelect(IsNull, NullDeepMetaPtr, SlotPtr, "deepptr_ptr");
+        MetaPtr = B.CreateLoad(SlotPtr, "deepptr");
+    }
     Value *New = buildFatPointer(Ptr, MetaPtr, B);
 
     /* Replace uses */
@@ -136,73 +217,42 @@ void MidFatPtrs::putMetaPointerInHighBits(Instruction *Ptr) {
         U->replaceUsesOfWith(Ptr, New);
 }
 
-static bool isMalloc(Function *F) {
-    /* TODO: str[n]dup, [posix_]memalign, msvc new ops */
-    static std::set<std::string> mallocFuncs = {
-        "malloc",
-        "valloc",
-        "_Znwj", /* new(unsigned int) */
-        "_ZnwjRKSt9nothrow_t",
-        "_Znwm", /* new(unsigned long) */
-        "_ZnwmRKSt9nothrow_t",
-        "_Znaj", /* new[](unsigned int) */
-        "_ZnajRKSt9nothrow_t",
-        "_Znam", /* new[](unsigned long) */
-        "_ZnamRKSt9nothrow_t",
-
-        /* custom allocators */
-        "Perl_safesysmalloc",
-        "xmalloc"
-    };
-    return mallocFuncs.find(F->getName().str()) != mallocFuncs.end();
-}
-
-static bool isCalloc(Function *F) {
-    return F->getName() == "calloc";
-}
-
-static bool isRealloc(Function *F) {
-    static std::set<std::string> reallocFuncs = {
-        "realloc",
-        "reallocf",
-
-        /* custom allocators */
-        "Perl_safesysrealloc",
-    };
-    return reallocFuncs.find(F->getName().str()) != reallocFuncs.end();
-}
-
 /*
  * Insert object size in pointers after allocations.
  *
  * Partially reimplements MemoryBuiltins.cpp from llvm to detect allocators.
  */
 void MidFatPtrs::instrumentCallAlloc(CallSite *CS) {
-    Instruction *Call = CS->getInstruction();
-    Function *F = CS->getCalledFunction();
-    if (!F || F->isIntrinsic())
-        return;
-
-    Function *parentFunc = CS->getParent()->getParent();
-
-    /* Ignore stdlib allocations in custom wrappers */
-    if (isMalloc(parentFunc) || isCalloc(parentFunc) || isRealloc(parentFunc))
-        return;
-
-    /* XXX Does crazy environ stuff. */
-    if (parentFunc->getName() == "Perl_my_setenv")
-        return;
+    if (Provenance::isFatAllocation(*CS) &&
+        !ThinAllocations.count(CS->getInstruction()))
+        putMetaPointerInHighBits(CS->getInstruction());
+}
 
-    if (isMalloc(F) || isCalloc(F) || isRealloc(F))
-        putMetaPointerInHighBits(Call);
+/*
+ * Find allocations whose metapointer is never read, which are left thin. This
+ * runs before any instrumentation (shims for external functions are metadata
+ * functions too), so that the provenance analysis sees the same allocations.
+ */
+void MidFatPtrs::findThinAllocations(Module &M) {
+    for (Function &F : M) {
+        if (F.isDeclaration() || ISMETADATAFUNC(F.getName().str().c_str()))
+            continue;
+        for (Instruction &I : instructions(F)) {
+            if (!isa<CallInst>(&I) && !isa<InvokeInst>(&I))
+                continue;
+            if (Provenance::isFatAllocation(ImmutableCallSite(&I)) &&
+                !Provenance::metaPtrMayBeUsed(&I))
+                ThinAllocations.insert(&I);
+        }
+    }
 }
 
-static void maskPointerArgs(CallSite *CS) {
+static void maskPointerArgs(CallSite *CS, const ExtFuncModel::Entry *E = nullptr) {
     IRBuilder<> B(CS->getInstruction());
 
     for (unsigned i = 0, n = CS->getNumArgOperands(); i < n; i++) {
         Value *arg = CS->getArgOperand(i);
-        if (arg->getType()->isPointerTy())
+        if (arg->getType()->isPointerTy() && (!E || E->masks(i)))
             CS->setArgument(i, maskPointer(arg, B));
     }
 }
@@ -224,7 +274,14 @@ void MidFatPtrs::instrumentCallExt(CallSite *CS) {
         F->getName().startswith("llvm.lifetime."))
         return;
 
-    maskPointerArgs(CS);
+    /* Modeled functions may only need some of their arguments masked, or
+     * have a replacement that accepts fat pointers */
+    const ExtFuncModel::Entry *E = Model.get(F);
+    if (E && !E->Shim.empty())
+        CS->setCalledFunction(F->getParent()->getOrInsertFunction(E->Shim,
+                    F->getFunctionType()));
+
+    maskPointerArgs(CS, E);
 }
 
 void MidFatPtrs::instrumentCallExtWrap(CallSite *CS) {
@@ -232,14 +289,11 @@ void MidFatPtrs::instrumentCallExtWrap(CallSite *CS) {
     if (CS->isInlineAsm() || !F)
         return;
 
-    if (F->getName() != "_E__pr_info" && /* sphinx3 vfprintf wrapper */
-        F->getName() != "_ZN12pov_frontend13MessageOutput6PrintfEiPKcz" && /* povray vsnprintf wrapper */
-        F->getName() != "_ZN8pov_base16TextStreamBuffer6printfEPKcz" && /* povray vsnprintf wrapper */
-        F->getName() != "_ZN3pov10Debug_InfoEPKcz" && /* povray vsnprintf wrapper */
-        F->getName() != "_ZN6cEnvir9printfmsgEPKcz") /* omnetpp vsprintf wrapper */
+    const ExtFuncModel::Entry *E = Model.get(F);
+    if (!E || !E->Wrapper)
         return;
 
-    maskPointerArgs(CS);
+    maskPointerArgs(CS, E);
 }
 
 void MidFatPtrs::instrumentCallByval(CallSite *CS) {
@@ -285,26 +339,18 @@ static void maskNestedPointers(Value *val, CompositeType *elTy,
 }
 
 void MidFatPtrs::instrumentCallExtNestedPtrs(CallSite *CS) {
-    static std::map<StringRef, std::vector<unsigned>> whitelist = {
-        /* inlined std::list::push_back */
-        {"_ZNSt8__detail15_List_node_base7_M_hookEPS0_", {1}},
-        /* inlined std::string += std::string */
-        {"_ZNSt7__cxx1112basic_stringIcSt11char_traitsIcESaIcEE9_M_appendEPKcm", {0}}
-    };
-
     Function *F = CS->getCalledFunction();
     if (!F)
         return;
 
-    auto it = whitelist.find(F->getName());
-    if (it == whitelist.end())
+    const ExtFuncModel::Entry *E = Model.get(F);
+    if (!E || E->NestedArgs.empty() || !F->isDeclaration())
         return;
 
-    assert(F->isDeclaration());
     IRBuilder<> B(CS->getInstruction());
     std::vector<Value*> indices = {B.getInt64(0)};
 
-    for (unsigned i : it->second) {
+    for (unsigned i : E->NestedArgs) {
         Value *arg = CS->getArgOperand(i);
         Type *elTy = cast<PointerType>(arg->getType())->getElementType();
         assert(elTy->isAggregateType());
@@ -322,6 +368,20 @@ void MidFatPtrs::instrumentCmpPtr(CmpInst *ins) {
         return;
 
     IRBuilder<> B(ins);
+
+    /* Equality and unsigned compares of zero-extended values give the same
+     * result on the low halves, so compare those directly */
+    if (useAddr32() && !cast<ICmpInst>(ins)->isSigned()) {
+        Value *low1 = B.CreateTrunc(B.CreatePtrToInt(arg1, B.getInt64Ty()), B.getInt32Ty(), "low");
+        Value *low2 = B.CreateTrunc(B.CreatePtrToInt(arg2, B.getInt64Ty()), B.getInt32Ty(), "low");
+        Value *cmp = B.CreateICmp(ins->getPredicate(), low1, low2, "cmp32");
+        /* The caller is iterating over the block, so leave the original
+         * compare for DCE */
+        ins->replaceAllUsesWith(cmp);
+        cmp->takeName(ins);
+        return;
+    }
+
     ins->setOperand(0, maskPointer(arg1, B));
     ins->setOperand(1, maskPointer(arg2, B));
 }
@@ -329,13 +389,16 @@ void MidFatPtrs::instrumentCmpPtr(CmpInst *ins) {
 /*
  * Mask out metadata bits in pointers when a pointer is accessed. It does not
  * mask out the overflow bit, so out-of-bound accesses will cause a fault.
+ * The masked pointer comes from a MaskCache, or from a PointerSplit with
+ * -midfat-split.
  */
-void MidFatPtrs::instrumentMemAccess(Instruction *ins) {
+template <class MaskSource>
+void MidFatPtrs::instrumentMemAccess(Instruction *ins, MaskSource &MS) {
     int ptrOperand = isa<StoreInst>(ins) ? 1 : 0;
     Value *ptr = ins->getOperand(ptrOperand);
 
     IRBuilder<> B(ins);
-    ins->setOperand(ptrOperand, maskPointer(ptr, B));
+    ins->setOperand(ptrOperand, MS.getMasked(ptr, ins));
 
     /* Also mask writes of pointers to externs (e.g., environ). */
     GlobalVariable *gv = dyn_cast<GlobalVariable>(ptr->stripPointerCasts());
@@ -367,6 +430,9 @@ bool MidFatPtrs::runOnFunction(Function &F) {
     if (&F == LookupMetaPtrFunc || F.getName() == "initialize_global_metapointers")
         return false;
 
+    if (F.isDeclaration())
+        return false;
+
     std::vector<Instruction*> mems;
     sinklist_t sinks;
     std::set<Instruction*> knownPtrInts;
@@ -375,9 +441,20 @@ bool MidFatPtrs::runOnFunction(Function &F) {
         for (Instruction &i : bb) {
             Instruction *ins = &i;
             if (isa<StoreInst>(ins) || isa<LoadInst>(ins)) {
-                mems.push_back(ins);
+                int ptrOperand = isa<StoreInst>(ins) ? 1 : 0;
+                Provenance::Category C = P.get(ins->getOperand(ptrOperand));
+                NumAccesses[C]++;
+                if (!UseProvenance || C != Provenance::Thin)
+                    mems.push_back(ins);
             }
             if (isPtrInt(ins)) {
+                /* ptrints of thin pointers are the same as their masked
+                 * value, so they never need to be masked at sinks */
+                ifcast(PtrToIntInst, ptrToInt, ins) {
+                    if (UseProvenance &&
+                            P.get(ptrToInt->getPointerOperand()) == Provenance::Thin)
+                        continue;
+                }
                 collectSinks(ins, sinks, knownPtrInts);
             }
         }
@@ -402,8 +479,39 @@ bool MidFatPtrs::runOnFunction(Function &F) {
 
     instrumentSinks(sinks);
 
+    if (SplitPointers) {
+        PointerSplit PS(F, maskPointer, UseProvenance ? &P : nullptr);
+        for (Instruction *mem : mems)
+            instrumentMemAccess(mem, PS);
+        PS.finalize();
+
+        DEBUG(dbgs() << "MidFatPtrs: " << F.getName() << ": " << PS.Accesses <<
+                " accesses, " << PS.Roots << " pointers split, " << PS.Rebuilt <<
+                " rebuilt, " << PS.Remasked << " masked again, " << PS.Recombined <<
+                " recombined\n");
+        return true;
+    }
+
+    /* Allocation instrumentation may have split blocks after invokes, so
+     * compute the analyses for mask placement only now */
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    TargetLibraryInfoImpl TLII(Triple(F.getParent()->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    AssumptionCache AC(F);
+    ScalarEvolution SE(F, TLI, AC, DT, LI);
+    MaskCache MC(DT, F.getParent()->getDataLayout(), maskPointer,
+            MaskHoist ? &LI : nullptr, MaskHoist ? &SE : nullptr);
+    MC.sortByDominance(mems);
+
     for (Instruction *mem : mems)
-        instrumentMemAccess(mem);
+        instrumentMemAccess(mem, MC);
+
+    DEBUG(dbgs() << "MidFatPtrs: " << F.getName() << ": " << MC.Accesses <<
+            " accesses, " << MC.Inserted << " masks inserted, " << MC.removed() <<
+            " removed (" << MC.Reused << " reused, " << MC.Derived << " derived, " <<
+            MC.Indexed << " indexed, " << MC.CarryChecked << " carry checked), " <<
+            MC.Hoisted << " hoisted\n");
 
     return true;
 }
@@ -445,24 +553,43 @@ static Function *createMetaPtrLookupHelper(Module &M) {
     Value *PageBase = B.CreateMul(Page, PageSize, "pagebase");
     Value *PageOffset = B.CreateSub(PtrInt, PageBase, "pageoffset");
     Value *PageOffsetShifted = B.CreateLShr(PageOffset, Alignment, "pageoffset_shr");
-    unsigned long OffsetShift = DeepMetadata ? sizeof (unsigned long) : MetadataBytes;
-    Value *MetaOffset = B.CreateMul(PageOffsetShifted, B.getInt64(OffsetShift), "metaoffset");
+    Value *MetaOffset = B.CreateMul(PageOffsetShifted, B.getInt64(metaSlotSize()), "metaoffset");
     Value *MetaPtr = B.CreateAdd(MetaBase, MetaOffset, "metaptr");
 
-    if (DeepMetadata) {
-        Value *CastMetaPtr = B.CreateIntToPtr(MetaPtr, i64->getPointerTo(), "deepptr_ptr");
-        MetaPtr = B.CreateLoad(CastMetaPtr, "deepptr");
-    }
-
     B.CreateRet(MetaPtr);
     return F;
 }
 
 bool MidFatPtrs::runOnModule(Module &M) {
+    /* Above 37 bits the metadata arena cannot describe the address space
+     * (see page_table_init) */
+    if (PtrBits < 32 || PtrBits > 37)
+        report_fatal_error("METALLOC_PTRBITS must be between 32 and 37");
+
+    Model.load();
+
+    if (ElideMetaPtrs)
+        findThinAllocations(M);
+
+    /* Analyze before instrumentation adds inttoptr casts everywhere */
+    if (UseProvenance)
+        P.analyze(M, &Model, &ThinAllocations);
+
     LookupMetaPtrFunc = createMetaPtrLookupHelper(M);
+    NullDeepMetaPtr = new GlobalVariable(M, Type::getInt64Ty(M.getContext()), true,
+            GlobalValue::InternalLinkage, ConstantInt::get(Type::getInt64Ty(M.getContext()), 0),
+            "midfat_null_deepmetaptr");
 
     for (Function &F : M)
         runOnFunction(F);
 
+    DEBUG(dbgs() << "MidFatPtrs: provenance of accessed pointers: " <<
+            NumAccesses[Provenance::Thin] << " thin (" <<
+            (UseProvenance ? "not masked" : "masked") << "), " <<
+            NumAccesses[Provenance::Fat] << " fat, " <<
+            NumAccesses[Provenance::PossiblyFat] << " possibly fat\n");
+    DEBUG(dbgs() << "MidFatPtrs: " << ThinAllocations.size() <<
+            " allocations left thin\n");
+
     return true;
 }
@@ -0,0 +1,40 @@
+#include <llvm/Pass.h>
+#include <llvm/PassInfo.h>
+#include <llvm/PassRegistry.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+
+#include <Utils.h>
+
+using namespace llvm;
+
+/*
+ * Run instrumentation passes per module at compile time, when the plugin is
+ * loaded into clang with -Xclang -load and the passes are listed in
+ * -mllvm -METALLOC_PERMODULE_PASSES=<pass>,<pass>,... in pipeline order.
+ * Translation units are then instrumented in parallel by the build system
+ * and unchanged ones are not instrumented again, instead of instrumenting
+ * the whole program serially during LTO.
+ *
+ * The passes only see their own module: GlobalTracker registers the globals
+ * of each module in a module constructor, and the safety analyses of
+ * DummyPass treat calls into other modules like calls to external functions.
+ */
+static void addPerModulePasses(const PassManagerBuilder &Builder,
+        legacy::PassManagerBase &PM) {
+    PassRegistry *Registry = PassRegistry::getPassRegistry();
+
+    for (const std::string &Name : PerModulePasses) {
+        const PassInfo *PI = Registry->getPassInfo(Name);
+        if (!PI || !PI->getNormalCtor())
+            report_fatal_error("METALLOC_PERMODULE_PASSES: unknown pass " + Name);
+        PM.add(PI->createPass());
+    }
+}
+
+static RegisterStandardPasses RegisterOpt(
+        PassManagerBuilder::EP_OptimizerLast, addPerModulePasses);
+static RegisterStandardPasses RegisterO0(
+        PassManagerBuilder::EP_EnabledOnOptLevel0, addPerModulePasses);
@@ -46,7 +46,7 @@ static inline bool isAnd(Instruction *I) {
 static bool andDefinitelyPreservesMetaPtr(Instruction *I, Instruction *PtrOp) {
     unsigned OtherOpIndex = I->getOperand(0) == PtrOp ? 1 : 0;
     ifcast(ConstantInt, Mask, I->getOperand(OtherOpIndex)) {
-        return Mask->getZExtValue() >= ~PTR_MASK;
+        return Mask->getZExtValue() >= ~ptrMask();
     }
     return false;
 }
@@ -58,7 +58,7 @@ static bool andDefinitelyPreservesMetaPtr(Instruction *I, Instruction *PtrOp) {
 static bool andDefinitelyZeroesMetaPtr(Instruction *I, Instruction *PtrOp) {
     unsigned OtherOpIndex = I->getOperand(0) == PtrOp ? 1 : 0;
     ifcast(ConstantInt, Mask, I->getOperand(OtherOpIndex)) {
-        return Mask->getZExtValue() <= PTR_MASK;
+        return Mask->getZExtValue() <= ptrMask();
     }
     return false;
 }
@@ -151,7 +151,7 @@ static bool isTrivialNonSinkOf(Instruction *I, Instruction *PtrInt) {
     ifcast(TruncInst, TI, I) {
         errs() << "found trunc:" << *TI << "\n";
         IntegerType *DestTy = cast<IntegerType>(TI->getDestTy());
-        return DestTy->getBitWidth() <= PTR_BITS;
+        return DestTy->getBitWidth() <= PtrBits;
     }
 
     return false;
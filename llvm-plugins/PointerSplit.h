@@ -0,0 +1,272 @@
+#ifndef POINTER_SPLIT_H
+#define POINTER_SPLIT_H
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Operator.h>
+
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "Utils.h"
+#include "Provenance.h"
+
+namespace llvm {
+
+typedef Value *(*maskfn_t)(Value *Ptr, IRBuilder<> &B);
+
+/*
+ * Register-split fat pointers. Within a function, every fat pointer that is
+ * dereferenced is decomposed into a thin half, the masked address, and a
+ * metadata half, the high bits as an i64. Pointers that come from outside
+ * the function's arithmetic (arguments, loads, calls, inttoptr) are split
+ * once where they are defined. GEPs, bitcasts, PHI nodes and selects on fat
+ * pointers are rebuilt on the thin halves, and their metadata halves follow
+ * the same PHI nodes and selects. Loads and stores then use the thin half
+ * directly, without a mask.
+ *
+ * The halves are recombined with an or only where a rebuilt pointer escapes
+ * (stored to memory, passed to a call, returned, converted to an integer or
+ * compared), after which the original fat pointer arithmetic is dead and is
+ * removed. This costs a register for the metadata half of every live fat
+ * pointer, but removes all masks from the accesses.
+ *
+ * Rebuilding the arithmetic on the thin half changes the result when an
+ * offset carries past bit PTR_BITS. The thin address then lies above 2^PTR_BITS
+ * (or below zero) instead of wrapping around, which only faults within the
+ * guard page above the reduced address space (isDerivableOffset). So the thin
+ * half of a GEP is only used as is when it is a known constant offset within
+ * the guard from the last mask. The thin halves of other GEPs, including any
+ * GEP on a PHI node or select, whose offset is not known, are masked again.
+ */
+class PointerSplit {
+public:
+    unsigned Accesses = 0;
+    unsigned Roots = 0;
+    unsigned Rebuilt = 0;
+    unsigned Remasked = 0;
+    unsigned Recombined = 0;
+
+    PointerSplit(Function &F, maskfn_t MaskFn, const Provenance *P = nullptr) :
+        F(F), MaskFn(MaskFn), P(P) {}
+
+    /*
+     * Get the thin half of Ptr for an access at InsertBefore. The thin half
+     * is available wherever Ptr is.
+     */
+    Value *getMasked(Value *Ptr, Instruction *InsertBefore) {
+        Accesses++;
+        return get(Ptr).Thin;
+    }
+
+    /*
+     * Recombine the halves at every use of a rebuilt pointer other than the
+     * thin halves and accesses, and remove the original fat pointer
+     * arithmetic. Must be called after all accesses have been rewritten.
+     * PHI nodes may list the same block more than once (switches), and must
+     * then get the same value for each entry.
+     */
+    void finalize() {
+        for (Instruction *I : Derived) {
+            std::vector<Use*> Uses;
+            std::map<BasicBlock*, Value*> PhiValues;
+            for (Use &U : I->uses())
+                Uses.push_back(&U);
+
+            for (Use *U : Uses) {
+                Instruction *User = cast<Instruction>(U->getUser());
+                if (Derived.count(User))
+                    continue;
+                ifcast(PHINode, PN, User) {
+                    BasicBlock *BB = PN->getIncomingBlock(*U);
+                    Value *&Fat = PhiValues[BB];
+                    if (!Fat)
+                        Fat = recombine(I, BB->getTerminator());
+                    U->set(Fat);
+                    continue;
+                }
+                U->set(recombine(I, User));
+            }
+        }
+
+        /* Only the derived instructions themselves still use each other */
+        for (Instruction *I : Derived)
+            I->dropAllReferences();
+        for (Instruction *I : Derived)
+            I->eraseFromParent();
+        Derived.clear();
+    }
+
+private:
+    /* Offset of the thin half from its last mask, if known */
+    static const int64_t UnknownOffset = INT64_MIN;
+
+    struct Halves {
+        Value *Thin;
+        Value *Meta;
+        int64_t Offset;
+    };
+
+    Function &F;
+    maskfn_t MaskFn;
+    const Provenance *P;
+    std::map<Value*, Halves> Splits;
+    std::set<Instruction*> Derived;
+
+    bool isThin(Value *V) {
+        return P && P->get(V) == Provenance::Thin;
+    }
+
+    static bool isDerivation(Value *V) {
+        if (!V->getType()->isPointerTy())
+            return false;
+        ifcast(BitCastInst, BC, V)
+            return BC->getSrcTy()->isPointerTy();
+        return isa<GetElementPtrInst>(V) || isa<PHINode>(V) || isa<SelectInst>(V);
+    }
+
+    Halves get(Value *V) {
+        auto It = Splits.find(V);
+        if (It != Splits.end())
+            return It->second;
+
+        Halves H;
+        Type *Int64Ty = Type::getInt64Ty(V->getContext());
+        if (isThin(V)) {
+            H = {V, ConstantInt::get(Int64Ty, 0), 0};
+        }
+        else if (isDerivation(V)) {
+            H = rebuild(cast<Instruction>(V));
+        }
+        else {
+            H = split(V);
+        }
+        Splits[V] = H;
+        return H;
+    }
+
+    /* Split a pointer where it is defined */
+    Halves split(Value *V) {
+        IRBuilder<> B(F.getContext());
+        if (Instruction *I = dyn_cast<Instruction>(V))
+            B.SetInsertPoint(getSplitInsertPoint(I));
+        else if (!isa<Constant>(V))
+            B.SetInsertPoint(&*F.getEntryBlock().getFirstInsertionPt());
+
+        Roots++;
+        Value *Thin = MaskFn(V, B);
+        Value *AsInt = B.CreatePtrToInt(V, B.getInt64Ty(), "as_int");
+        Value *Meta = B.CreateAnd(AsInt, ~ptrMask(), "meta");
+        return {Thin, Meta, 0};
+    }
+
+    /*
+     * Splits of the results of calls and loads go after them. For invokes,
+     * the instruction after them is in the normal destination, which is
+     * dominated by the invoke as long as it has no other predecessors.
+     */
+    Instruction *getSplitInsertPoint(Instruction *I) {
+        ifcast(InvokeInst, Invoke, I) {
+            BasicBlock *Dest = Invoke->getNormalDest();
+            if (!Dest->getSinglePredecessor()) {
+                Dest = BasicBlock::Create(I->getContext(), "invoke_split",
+                        &F, Dest);
+                BranchInst::Create(Invoke->getNormalDest(), Dest);
+                for (Instruction &Phi : *Invoke->getNormalDest()) {
+                    PHINode *PN = dyn_cast<PHINode>(&Phi);
+                    if (!PN)
+                        break;
+                    int Idx;
+                    while ((Idx = PN->getBasicBlockIndex(Invoke->getParent())) >= 0)
+                        PN->setIncomingBlock(Idx, Dest);
+                }
+                Invoke->setNormalDest(Dest);
+            }
+            return &*Dest->getFirstInsertionPt();
+        }
+        return &*std::next(BasicBlock::iterator(I));
+    }
+
+    /* Rebuild pointer arithmetic on the thin halves of its operands */
+    Halves rebuild(Instruction *I) {
+        Derived.insert(I);
+        Rebuilt++;
+
+        ifcast(PHINode, PN, I) {
+            /* Register the halves before visiting the incoming values, which
+             * may depend on this PHI node in a loop */
+            PHINode *Thin = PHINode::Create(PN->getType(), PN->getNumIncomingValues(),
+                    PN->getName() + ".thin", PN);
+            PHINode *Meta = PHINode::Create(Type::getInt64Ty(PN->getContext()),
+                    PN->getNumIncomingValues(), PN->getName() + ".meta", PN);
+            Splits[PN] = {Thin, Meta, UnknownOffset};
+            for (unsigned i = 0, n = PN->getNumIncomingValues(); i < n; i++) {
+                Halves In = get(PN->getIncomingValue(i));
+                Thin->addIncoming(In.Thin, PN->getIncomingBlock(i));
+                Meta->addIncoming(In.Meta, PN->getIncomingBlock(i));
+            }
+            return {Thin, Meta, UnknownOffset};
+        }
+
+        ifcast(SelectInst, Sel, I) {
+            Halves True = get(Sel->getTrueValue());
+            Halves False = get(Sel->getFalseValue());
+            IRBuilder<> B(Sel);
+            Value *Thin = B.CreateSelect(Sel->getCondition(), True.Thin, False.Thin,
+                    Sel->getName() + ".thin");
+            Value *Meta = B.CreateSelect(Sel->getCondition(), True.Meta, False.Meta,
+                    Sel->getName() + ".meta");
+            return {Thin, Meta, UnknownOffset};
+        }
+
+        /* GEPs and bitcasts keep the metadata of their base */
+        unsigned PtrOperand = isa<GetElementPtrInst>(I) ?
+            GetElementPtrInst::getPointerOperandIndex() : 0;
+        Halves Base = get(I->getOperand(PtrOperand));
+        Instruction *Thin = I->clone();
+        Thin->setOperand(PtrOperand, Base.Thin);
+        Thin->setName(I->getName() + ".thin");
+        Thin->insertBefore(I);
+        if (isa<BitCastInst>(I))
+            return {Thin, Base.Meta, Base.Offset};
+
+        int64_t Offset = getDerivedOffset(cast<GEPOperator>(I), Base.Offset);
+        if (Offset != UnknownOffset)
+            return {Thin, Base.Meta, Offset};
+
+        IRBuilder<> B(I);
+        Remasked++;
+        return {MaskFn(Thin, B), Base.Meta, 0};
+    }
+
+    /* Offset of a GEP from the last mask, if it stays within the guard */
+    int64_t getDerivedOffset(GEPOperator *GEP, int64_t BaseOffset) {
+        const DataLayout &DL = F.getParent()->getDataLayout();
+        APInt GEPOffset(64, 0);
+        if (BaseOffset == UnknownOffset ||
+                !GEP->accumulateConstantOffset(DL, GEPOffset) ||
+                !isDerivableOffset(GEPOffset.getSExtValue()) ||
+                !isDerivableOffset(BaseOffset + GEPOffset.getSExtValue()))
+            return UnknownOffset;
+        return BaseOffset + GEPOffset.getSExtValue();
+    }
+
+    /* The fat pointer of a rebuilt pointer, recombined from its halves */
+    Value *recombine(Instruction *I, Instruction *InsertBefore) {
+        Halves H = Splits[I];
+        IRBuilder<> B(InsertBefore);
+        Value *ThinInt = B.CreatePtrToInt(H.Thin, B.getInt64Ty(), "thin_int");
+        Value *Fat = B.CreateOr(ThinInt, H.Meta, "recombined");
+        Recombined++;
+        return B.CreateIntToPtr(Fat, I->getType(), "fatptr");
+    }
+};
+
+}
+
+#endif /* !POINTER_SPLIT_H */
@@ -0,0 +1,73 @@
+#include <llvm/Pass.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+
+#define DEBUG_TYPE "postopt"
+
+using namespace llvm;
+
+enum OptLevel {
+    O0, O1, O2, O3
+};
+
+static cl::opt<OptLevel> PostOptLevel("midfat-post-opt",
+        cl::desc("Optimization level of the cleanup after instrumentation"),
+        cl::values(
+            clEnumVal(O0, "No cleanup"),
+            clEnumVal(O1, "Basic cleanup (InstCombine, EarlyCSE, SimplifyCFG)"),
+            clEnumVal(O2, "Also GVN and LICM"),
+            clEnumVal(O3, "Also aggressive loop and vector optimizations"),
+            clEnumValEnd),
+        cl::init(O2));
+
+/*
+ * Cleanup of the code inserted by the instrumentation passes, which run after
+ * LTO has optimized the program. Add -postopt after the instrumentation
+ * passes to run the standard function and module pipelines again, so that
+ * identical masks are merged by CSE/GVN, metapointer lookups and masks of
+ * loop-invariant pointers are hoisted by LICM and the shifts, ands and casts
+ * are folded by InstCombine. Inlining decisions are left to the LTO inliner
+ * and CustomInliner, only always_inline helpers (lookup_metaptr) are inlined.
+ */
+struct PostOpt : public ModulePass {
+    static char ID;
+    PostOpt() : ModulePass(ID) {}
+
+    bool runOnModule(Module &M) override {
+        if (PostOptLevel == O0)
+            return false;
+
+        PassManagerBuilder PMB;
+        PMB.OptLevel = PostOptLevel;
+        PMB.SizeLevel = 0;
+        PMB.Inliner = createAlwaysInlinerPass();
+        PMB.DisableUnrollLoops = PostOptLevel < O3;
+        PMB.LoopVectorize = PostOptLevel >= O3;
+        PMB.SLPVectorize = PostOptLevel >= O3;
+
+        legacy::FunctionPassManager FPM(&M);
+        legacy::PassManager MPM;
+        PMB.populateFunctionPassManager(FPM);
+        PMB.populateModulePassManager(MPM);
+
+        FPM.doInitialization();
+        for (Function &F : M) {
+            if (!F.isDeclaration())
+                FPM.run(F);
+        }
+        FPM.doFinalization();
+        MPM.run(M);
+
+        DEBUG(dbgs() << "PostOpt: ran O" << (unsigned)PostOptLevel << " pipeline\n");
+        return true;
+    }
+};
+
+char PostOpt::ID = 0;
+static RegisterPass<PostOpt> X("postopt",
+        "Optimize after instrumentation (level set with -midfat-post-opt)");
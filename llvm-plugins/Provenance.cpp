@@ -0,0 +1,286 @@
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/CallSite.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Debug.h>
+
+#include <set>
+#include <string>
+
+#include <metadata.h>
+
+#include "Utils.h"
+#include "Provenance.h"
+
+#define DEBUG_TYPE "provenance"
+
+using namespace llvm;
+
+bool isMalloc(const Function *F) {
+    /* TODO: str[n]dup, [posix_]memalign, msvc new ops */
+    static std::set<std::string> mallocFuncs = {
+        "malloc",
+        "valloc",
+        "_Znwj", /* new(unsigned int) */
+        "_ZnwjRKSt9nothrow_t",
+        "_Znwm", /* new(unsigned long) */
+        "_ZnwmRKSt9nothrow_t",
+        "_Znaj", /* new[](unsigned int) */
+        "_ZnajRKSt9nothrow_t",
+        "_Znam", /* new[](unsigned long) */
+        "_ZnamRKSt9nothrow_t",
+
+        /* custom allocators */
+        "Perl_safesysmalloc",
+        "xmalloc"
+    };
+    return mallocFuncs.find(F->getName().str()) != mallocFuncs.end();
+}
+
+bool isCalloc(const Function *F) {
+    return F->getName() == "calloc";
+}
+
+bool isRealloc(const Function *F) {
+    static std::set<std::string> reallocFuncs = {
+        "realloc",
+        "reallocf",
+
+        /* custom allocators */
+        "Perl_safesysrealloc",
+    };
+    return reallocFuncs.find(F->getName().str()) != reallocFuncs.end();
+}
+
+static bool isAllocator(const Function *F) {
+    return isMalloc(F) || isCalloc(F) || isRealloc(F);
+}
+
+static bool isFree(const Function *F) {
+    static std::set<std::string> freeFuncs = {
+        "free",
+        "cfree",
+        "_ZdlPv", /* delete(void*) */
+        "_ZdlPvRKSt9nothrow_t",
+        "_ZdaPv", /* delete[](void*) */
+        "_ZdaPvRKSt9nothrow_t",
+
+        /* custom allocators */
+        "Perl_safesysfree",
+    };
+    return freeFuncs.find(F->getName().str()) != freeFuncs.end();
+}
+
+bool Provenance::isFatAllocation(ImmutableCallSite CS) {
+    const Function *F = CS.getCalledFunction();
+    if (!F || F->isIntrinsic())
+        return false;
+
+    const Function *parentFunc = CS.getParent()->getParent();
+
+    /* Ignore stdlib allocations in custom wrappers */
+    if (isAllocator(parentFunc))
+        return false;
+
+    /* XXX Does crazy environ stuff. */
+    if (parentFunc->getName() == "Perl_my_setenv")
+        return false;
+
+    return isAllocator(F);
+}
+
+bool Provenance::metaPtrMayBeUsed(const Instruction *Alloc) {
+    SmallPtrSet<const Value*, 16> Visited;
+    SmallVector<const Value*, 8> Worklist;
+    Worklist.push_back(Alloc);
+
+    while (!Worklist.empty()) {
+        const Value *V = Worklist.pop_back_val();
+        for (const Use &U : V->uses()) {
+            const User *Usr = U.getUser();
+
+            if (isa<GetElementPtrInst>(Usr) || isa<BitCastInst>(Usr) ||
+                isa<AddrSpaceCastInst>(Usr) || isa<PHINode>(Usr) ||
+                isa<SelectInst>(Usr)) {
+                if (Visited.insert(Usr).second)
+                    Worklist.push_back(Usr);
+                continue;
+            }
+
+            /* Accesses through the pointer and comparisons */
+            if (isa<LoadInst>(Usr) || isa<ICmpInst>(Usr))
+                continue;
+            ifcast(const StoreInst, SI, Usr) {
+                if (SI->getValueOperand() == V)
+                    return true;
+                continue;
+            }
+
+            /* Calls that do not keep the pointer, like free and memcpy. The
+             * nocapture that FunctionAttrs infers on instrumented functions
+             * does not count, since they check their arguments themselves. */
+            if (isa<CallInst>(Usr) || isa<InvokeInst>(Usr)) {
+                ImmutableCallSite CS(cast<Instruction>(Usr));
+                const Function *F = CS.getCalledFunction();
+                if (!CS.isArgOperand(&U) || !F ||
+                    ISMETADATAFUNC(F->getName().str().c_str()) ||
+                    !(F->isDeclaration() || isAllocator(F) || isFree(F)) ||
+                    !CS.doesNotCapture(CS.getArgumentNo(&U)))
+                    return true;
+                continue;
+            }
+
+            /* Returns, ptrtoint (which the checks take), atomics, ... */
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *Provenance::name(Category C) {
+    switch (C) {
+        case Unknown:     return "unknown";
+        case Thin:        return "thin";
+        case Fat:         return "fat";
+        case PossiblyFat: return "possibly-fat";
+    }
+    return "invalid";
+}
+
+Provenance::Category Provenance::lookup(const Value *V) const {
+    /* Addresses of globals and functions, null and constant expressions
+     * over them never carry metadata */
+    if (isa<Constant>(V))
+        return Thin;
+
+    auto it = Categories.find(V);
+    return it == Categories.end() ? Unknown : it->second;
+}
+
+Provenance::Category Provenance::get(const Value *V) const {
+    /* Values that no source reached (dead code, uncalled functions) are
+     * treated conservatively */
+    Category C = lookup(V);
+    return C == Unknown ? PossiblyFat : C;
+}
+
+/*
+ * Arguments of internal functions that are only called directly get the
+ * join of the actual arguments at all call sites; the callers of other
+ * functions are unknown.
+ */
+Provenance::Category Provenance::argument(const Function &F, const Argument &A) const {
+    if (!F.hasLocalLinkage() || F.hasAddressTaken())
+        return PossiblyFat;
+
+    unsigned C = Unknown;
+    for (const User *U : F.users()) {
+        ImmutableCallSite CS(U);
+        if (!CS || A.getArgNo() >= CS.arg_size())
+            return PossiblyFat;
+        C |= lookup(CS.getArgument(A.getArgNo()));
+    }
+    return (Category)C;
+}
+
+Provenance::Category Provenance::transfer(const Instruction *I) const {
+    if (isa<AllocaInst>(I))
+        return Thin;
+
+    ifcast(const GetElementPtrInst, GEP, I)
+        return lookup(GEP->getPointerOperand());
+
+    if (isa<BitCastInst>(I) || isa<AddrSpaceCastInst>(I))
+        return lookup(I->getOperand(0));
+
+    ifcast(const PHINode, PN, I) {
+        unsigned C = Unknown;
+        for (const Value *V : PN->incoming_values())
+            C |= lookup(V);
+        return (Category)C;
+    }
+
+    ifcast(const SelectInst, SI, I)
+        return (Category)(lookup(SI->getTrueValue()) | lookup(SI->getFalseValue()));
+
+    if (isa<CallInst>(I) || isa<InvokeInst>(I)) {
+        ImmutableCallSite CS(I);
+        if (isFatAllocation(CS))
+            return ThinAllocations && ThinAllocations->count(I) ? Thin : Fat;
+
+        /* Return values of defined functions are known, unless the
+         * definition may be replaced at link time */
+        const Function *F = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+        if (F && !F->isDeclaration() && !F->mayBeOverridden()) {
+            auto it = Returns.find(F);
+            return it == Returns.end() ? Unknown : it->second;
+        }
+
+        const ExtFuncModel::Entry *E = Model ? Model->get(F) : nullptr;
+        if (E && E->Ret == ExtFuncModel::RetThin)
+            return Thin;
+        if (E && E->Ret == ExtFuncModel::RetArg && E->RetArgNo < CS.arg_size())
+            return lookup(CS.getArgument(E->RetArgNo));
+        return PossiblyFat;
+    }
+
+    /* Loads, inttoptr, extractvalue, va_arg, ... */
+    return PossiblyFat;
+}
+
+bool Provenance::update(const Value *V, Category C) {
+    Category Old = lookup(V);
+    Category New = (Category)(Old | C);
+    if (New == Old)
+        return false;
+    Categories[V] = New;
+    return true;
+}
+
+void Provenance::analyze(Module &M, const ExtFuncModel *Model,
+        const std::set<const Instruction*> *ThinAllocations) {
+    this->Model = Model;
+    this->ThinAllocations = ThinAllocations;
+    unsigned Iterations = 0;
+    bool Changed = true;
+
+    while (Changed) {
+        Changed = false;
+        Iterations++;
+
+        for (Function &F : M) {
+            if (F.isDeclaration())
+                continue;
+
+            for (Argument &A : F.args()) {
+                if (A.getType()->isPointerTy())
+                    Changed |= update(&A, argument(F, A));
+            }
+
+            for (inst_iterator It = inst_begin(F), E = inst_end(F); It != E; ++It) {
+                Instruction *I = &*It;
+                if (I->getType()->isPointerTy())
+                    Changed |= update(I, transfer(I));
+
+                ifcast(ReturnInst, RI, I) {
+                    Value *RetVal = RI->getReturnValue();
+                    if (!RetVal || !RetVal->getType()->isPointerTy())
+                        continue;
+                    Category Old = Returns.count(&F) ? Returns[&F] : Unknown;
+                    Category New = (Category)(Old | lookup(RetVal));
+                    if (New != Old) {
+                        Returns[&F] = New;
+                        Changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    DEBUG(dbgs() << "Provenance: fixpoint after " << Iterations << " iterations\n");
+}
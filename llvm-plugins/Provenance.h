@@ -0,0 +1,102 @@
+#ifndef PROVENANCE_H
+#define PROVENANCE_H
+
+#include <llvm/IR/CallSite.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/Analysis/ValueTracking.h>
+
+#include <map>
+#include <set>
+
+#include "ExtFuncModel.h"
+
+/*
+ * Module-wide analysis of where pointers may get metadata in their high bits
+ * from. Under mid-fat pointers, only pointers returned by allocators are made
+ * fat, so pointers derived from allocas, globals and constants never carry
+ * metadata. Provenance follows GEPs, casts, PHI nodes and selects within a
+ * function, and arguments and return values of internal functions across the
+ * module (which in LTO is most of them). Return values of external functions
+ * come from their model, if any. Loads, inttoptr, calls to other external
+ * functions and anything else may produce a fat pointer.
+ *
+ * The categories form a lattice where Thin | Fat == PossiblyFat, and the
+ * analysis iterates to a fixpoint over the whole module.
+ */
+class Provenance {
+public:
+    enum Category {
+        Unknown = 0,
+        Thin = 1,
+        Fat = 2,
+        PossiblyFat = Thin | Fat
+    };
+
+    void analyze(llvm::Module &M, const ExtFuncModel *Model = nullptr,
+            const std::set<const llvm::Instruction*> *ThinAllocations = nullptr);
+    Category get(const llvm::Value *V) const;
+
+    static const char *name(Category C);
+
+    /* Whether MidFatPtrs puts the metapointer in the result of this call */
+    static bool isFatAllocation(llvm::ImmutableCallSite CS);
+
+    /*
+     * Whether the metapointer of an allocation may ever be read: its pointer
+     * reaches a metadata function (the checks of the dummy and bounds checks
+     * passes) or escapes the function. Otherwise, the allocation can stay
+     * thin, for which metaget returns zero.
+     */
+    static bool metaPtrMayBeUsed(const llvm::Instruction *Alloc);
+
+private:
+    std::map<const llvm::Value*, Category> Categories;
+    std::map<const llvm::Function*, Category> Returns;
+    const ExtFuncModel *Model = nullptr;
+    const std::set<const llvm::Instruction*> *ThinAllocations = nullptr;
+
+    Category lookup(const llvm::Value *V) const;
+    Category transfer(const llvm::Instruction *I) const;
+    Category argument(const llvm::Function &F, const llvm::Argument &A) const;
+    bool update(const llvm::Value *V, Category C);
+};
+
+bool isMalloc(const llvm::Function *F);
+bool isCalloc(const llvm::Function *F);
+bool isRealloc(const llvm::Function *F);
+
+/*
+ * Check if an access of AccessSize bytes through Ptr stays within a stack or
+ * global object, by being at a constant offset from it. Such accesses never
+ * need to be masked, even for SFI, because they cannot reach outside memory
+ * that the program owns.
+ */
+static inline bool isKnownObjectAccess(llvm::Value *Ptr, uint64_t AccessSize,
+        const llvm::DataLayout &DL) {
+    int64_t Offset = 0;
+    llvm::Value *Base = llvm::GetPointerBaseWithConstantOffset(Ptr, Offset, DL);
+    uint64_t ObjectSize;
+
+    if (llvm::AllocaInst *AI = llvm::dyn_cast<llvm::AllocaInst>(Base)) {
+        llvm::ConstantInt *N = llvm::dyn_cast<llvm::ConstantInt>(AI->getArraySize());
+        if (!N)
+            return false;
+        ObjectSize = DL.getTypeAllocSize(AI->getAllocatedType()) * N->getZExtValue();
+    }
+    else if (llvm::GlobalVariable *GV = llvm::dyn_cast<llvm::GlobalVariable>(Base)) {
+        /* Externally defined globals may have a different size */
+        if (GV->isDeclaration() || GV->mayBeOverridden())
+            return false;
+        ObjectSize = DL.getTypeAllocSize(GV->getType()->getElementType());
+    }
+    else {
+        return false;
+    }
+
+    return Offset >= 0 && (uint64_t)Offset + AccessSize <= ObjectSize;
+}
+
+#endif /* !PROVENANCE_H */
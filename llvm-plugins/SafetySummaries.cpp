@@ -0,0 +1,76 @@
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/CallSite.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Support/Debug.h>
+
+#include <SafetySummaries.h>
+
+#define DEBUG_TYPE "safetysummaries"
+
+using namespace llvm;
+
+void SafetySummaries::compute(Module &M) {
+    TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    CallGraph CG(M);
+    unsigned NumArgs = 0, NumNotCaptured = 0;
+
+    for (scc_iterator<CallGraph*> I = scc_begin(&CG); !I.isAtEnd(); ++I) {
+        for (CallGraphNode *Node : *I) {
+            Function *F = Node->getFunction();
+            if (!F || F->isDeclaration())
+                continue;
+
+            DominatorTree DT(*F);
+            LoopInfo LI(DT);
+            AssumptionCache AC(*F);
+            ScalarEvolution SE(*F, TLI, AC, DT, LI);
+            SafetyManager SM(&M.getDataLayout(), &SE, this);
+
+            for (Argument &A : F->args()) {
+                if (!A.getType()->isPointerTy())
+                    continue;
+                ArgSummary Summary = SM.SummarizeArgument(&A);
+                if (A.hasByValAttr()) {
+                    // The call copies the object, the callee never sees the
+                    // caller's pointer
+                    unsigned BitWidth = Summary.Accessed.getBitWidth();
+                    Summary.Captured = false;
+                    Summary.Accessed = ConstantRange(APInt(BitWidth, 0),
+                            APInt(BitWidth, SM.GetByvalArgumentSize(&A)));
+                }
+                NumArgs++;
+                if (!Summary.Captured)
+                    NumNotCaptured++;
+                DEBUG(dbgs() << "[SafetySummaries] " << F->getName() << " arg " <<
+                        A.getArgNo() << ": " << (Summary.Captured ? "captured" : "not captured") <<
+                        ", accessed " << Summary.Accessed << "\n");
+                Summaries.insert(std::make_pair(&A, Summary));
+            }
+        }
+    }
+
+    DEBUG(dbgs() << "[SafetySummaries] " << NumNotCaptured << " of " << NumArgs <<
+            " pointer arguments not captured\n");
+}
+
+const ArgSummary *SafetySummaries::get(ImmutableCallSite CS, unsigned ArgNo) const {
+    const Function *F = CS.getCalledFunction();
+    if (!F || F->isDeclaration() || F->mayBeOverridden())
+        return nullptr;
+    if (ArgNo >= F->arg_size())
+        return nullptr;
+
+    Function::const_arg_iterator A = F->arg_begin();
+    std::advance(A, ArgNo);
+    auto it = Summaries.find(&*A);
+    return it == Summaries.end() ? nullptr : &it->second;
+}
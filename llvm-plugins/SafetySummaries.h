@@ -0,0 +1,29 @@
+#ifndef SAFETY_SUMMARIES_H
+#define SAFETY_SUMMARIES_H
+
+#include <llvm/IR/CallSite.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+
+#include <map>
+
+#include <Utils.h>
+
+/*
+ * Interprocedural summaries of pointer arguments, for SafetyManager to decide
+ * whether passing a pointer to a stack object or byval argument to a call is
+ * safe. Summaries are computed bottom-up over the SCCs of the call graph, so
+ * the summaries of callees are available when analyzing their callers. Calls
+ * within a recursive SCC are treated as unknown, as are calls to external
+ * functions and to definitions that may be replaced at link time.
+ */
+class SafetySummaries {
+public:
+    void compute(llvm::Module &M);
+    const ArgSummary *get(llvm::ImmutableCallSite CS, unsigned ArgNo) const;
+
+private:
+    std::map<const llvm::Argument*, ArgSummary> Summaries;
+};
+
+#endif /* !SAFETY_SUMMARIES_H */
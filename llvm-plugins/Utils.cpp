@@ -26,6 +26,7 @@
 #include <llvm/Analysis/ScalarEvolutionExpressions.h>
 
 #include <Utils.h>
+#include <SafetySummaries.h>
 #include <algorithm>
 
 #define DEBUG_TYPE "safetymanager"
@@ -48,6 +49,11 @@ cl::opt<unsigned long> DeepMetadataBytes ("METALLOC_DEEPMETADATABYTES", cl::desc
         clEnumVal(16, ""),
         clEnumVal(32, ""),
         clEnumValEnd));
+cl::opt<unsigned> PtrBits ("METALLOC_PTRBITS", cl::desc("Number of address bits in fat pointers, as PTR_BITS of staticlib"), cl::init(32));
+cl::opt<bool> UseSafetySummaries ("METALLOC_SAFETYSUMMARIES", cl::desc("Use interprocedural summaries of pointer arguments to prove calls safe"), cl::init(true));
+cl::opt<bool> MaskCSE ("mask-cse", cl::desc("Reuse pointer masks in dominated accesses instead of masking every access"), cl::init(true));
+cl::opt<bool> MaskHoist ("mask-hoist", cl::desc("Hoist masks of loop-invariant pointers into loop preheaders"), cl::init(true));
+cl::list<std::string> PerModulePasses ("METALLOC_PERMODULE_PASSES", cl::desc("Instrumentation passes to run per module at compile time instead of during LTO"), cl::CommaSeparated);
 
 /// Rewrite an SCEV expression for a memory access address to an expression that
 /// represents offset from the given alloca.
@@ -127,6 +133,52 @@ bool SafetyManager::IsAccessSafe(Value *Addr, unsigned long AccessSize,
   return Safe;
 }
 
+/// Get the range of byte offsets of an address from a base pointer, or the
+/// full set if the address is not derived from the base in a way SCEV
+/// understands.
+ConstantRange SafetyManager::GetOffsetRange(const Value *Addr, const Value *BasePtr) {
+  AllocaOffsetRewriter Rewriter(*SE, BasePtr);
+  const SCEV *Expr = Rewriter.visit(SE->getSCEV(const_cast<Value*>(Addr)));
+  return SE->getSignedRange(Expr);
+}
+
+/// Check whether passing a pointer into an object as a call argument is safe,
+/// i.e., the callee does not capture it and only accesses the object within
+/// its bounds.
+bool SafetyManager::IsCallArgSafe(ImmutableCallSite CS, unsigned ArgNo, const Value *V,
+                              const Value *AllocaPtr, unsigned long AllocaSize) {
+  // LLVM 'nocapture' attribute is only set for arguments whose address
+  // is not stored, passed around, or used in any other non-trivial way.
+  // We assume that passing a pointer to an object as a 'nocapture
+  // readnone' argument is safe.
+  if (CS.doesNotCapture(ArgNo) && (CS.doesNotAccessMemory(ArgNo) ||
+                                   CS.doesNotAccessMemory()))
+    return true;
+
+  // Otherwise, look at all uses of the argument inside the function being
+  // called, as summarized over the module.
+  const ArgSummary *Summary = Summaries ? Summaries->get(CS, ArgNo) : nullptr;
+  if (!Summary || Summary->Captured || AllocaSize == 0)
+    return false;
+  if (Summary->Accessed.isEmptySet())
+    return true;
+
+  ConstantRange AccessRange = GetOffsetRange(V, AllocaPtr).add(Summary->Accessed);
+  unsigned long BitWidth = AccessRange.getBitWidth();
+  ConstantRange AllocaRange =
+      ConstantRange(APInt(BitWidth, 0), APInt(BitWidth, AllocaSize));
+  bool Safe = AllocaRange.contains(AccessRange);
+
+  DEBUG(dbgs() << "[SafeStack] Call " << *CS.getInstruction() << "\n"
+               << "            Argument " << ArgNo << " accesses "
+               << Summary->Accessed << "\n"
+               << "            Range " << AccessRange << "\n"
+               << "            AllocaRange " << AllocaRange << "\n"
+               << "            " << (Safe ? "safe" : "unsafe") << "\n");
+
+  return Safe;
+}
+
 bool SafetyManager::IsMemIntrinsicSafe(const MemIntrinsic *MI, const Use &U,
                                    const Value *AllocaPtr,
                                    unsigned long AllocaSize) {
@@ -204,18 +256,10 @@ bool SafetyManager::IsSafeStackAlloca(const Value *AllocaPtr, unsigned long Allo
           continue;
         }
 
-        // LLVM 'nocapture' attribute is only set for arguments whose address
-        // is not stored, passed around, or used in any other non-trivial way.
-        // We assume that passing a pointer to an object as a 'nocapture
-        // readnone' argument is safe.
-        // FIXME: a more precise solution would require an interprocedural
-        // analysis here, which would look at all uses of an argument inside
-        // the function being called.
         ImmutableCallSite::arg_iterator B = CS.arg_begin(), E = CS.arg_end();
         for (ImmutableCallSite::arg_iterator A = B; A != E; ++A)
           if (A->get() == V)
-            if (!(CS.doesNotCapture(A - B) && (CS.doesNotAccessMemory(A - B) ||
-                                               CS.doesNotAccessMemory()))) {
+            if (!IsCallArgSafe(CS, A - B, V, AllocaPtr, AllocaSize)) {
               DEBUG(dbgs() << "[SafeStack] Unsafe alloca: " << *AllocaPtr
                            << "\n            unsafe call: " << *I << "\n");
               return false;
@@ -342,8 +386,7 @@ void SafetyManager::AccumulateUnsafeSideEffects(const Value *AllocaPtr, unsigned
         ImmutableCallSite::arg_iterator B = CS.arg_begin(), E = CS.arg_end();
         for (ImmutableCallSite::arg_iterator A = B; A != E; ++A)
           if (A->get() == V)
-            if (!(CS.doesNotCapture(A - B) && (CS.doesNotAccessMemory(A - B) ||
-                                               CS.doesNotAccessMemory()))) {
+            if (!IsCallArgSafe(CS, A - B, V, AllocaPtr, AllocaSize)) {
               UnsafeSideEffects.insert(std::make_pair(I, V));
             }
         break;
@@ -542,3 +585,99 @@ void makeAllConstantUsesInstructions(Constant *C) {
     U->dropAllReferences();
   }
 }
+
+/// Summarize how a function uses a pointer argument, for use by the callers of
+/// the function. Calls are resolved through the summaries of the callees,
+/// which are computed first.
+ArgSummary SafetyManager::SummarizeArgument(const Argument *Arg) {
+  unsigned BitWidth = DL->getPointerTypeSizeInBits(Arg->getType());
+  ArgSummary Unsafe(BitWidth);
+  ConstantRange Accessed(BitWidth, false);
+
+  SmallPtrSet<const Value *, 16> Visited;
+  SmallVector<const Value *, 8> WorkList;
+  WorkList.push_back(Arg);
+
+  // A DFS search through all uses of the argument in bitcasts/PHI/GEPs/etc.
+  while (!WorkList.empty()) {
+    const Value *V = WorkList.pop_back_val();
+    for (const Use &UI : V->uses()) {
+      auto I = cast<const Instruction>(UI.getUser());
+
+      switch (I->getOpcode()) {
+      case Instruction::Load: {
+        ConstantRange Size(APInt(BitWidth, 0), APInt(BitWidth, DL->getTypeStoreSize(I->getType())));
+        Accessed = Accessed.unionWith(GetOffsetRange(V, Arg).add(Size));
+        break;
+      }
+      case Instruction::VAArg:
+        break;
+      case Instruction::Store: {
+        if (V == I->getOperand(0))
+          return Unsafe;
+        ConstantRange Size(APInt(BitWidth, 0), APInt(BitWidth, DL->getTypeStoreSize(I->getOperand(0)->getType())));
+        Accessed = Accessed.unionWith(GetOffsetRange(V, Arg).add(Size));
+        break;
+      }
+      case Instruction::AtomicRMW:
+      case Instruction::AtomicCmpXchg: {
+        // Only the pointer operand is an access; storing the argument
+        // itself (or comparing against it) lets it escape.
+        if (UI.getOperandNo() != 0)
+          return Unsafe;
+        const Value *Val = I->getOperand(I->getNumOperands() - 1);
+        ConstantRange Size(APInt(BitWidth, 0), APInt(BitWidth, DL->getTypeStoreSize(Val->getType())));
+        Accessed = Accessed.unionWith(GetOffsetRange(V, Arg).add(Size));
+        break;
+      }
+      case Instruction::Ret:
+        return Unsafe;
+
+      case Instruction::Call:
+      case Instruction::Invoke: {
+        ImmutableCallSite CS(I);
+
+        if (const IntrinsicInst *II = dyn_cast<IntrinsicInst>(I)) {
+          if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+              II->getIntrinsicID() == Intrinsic::lifetime_end)
+            continue;
+        }
+
+        if (const MemIntrinsic *MI = dyn_cast<MemIntrinsic>(I)) {
+          const auto *Len = dyn_cast<ConstantInt>(MI->getLength());
+          if (!Len || UI.getOperandNo() > 1)
+            return Unsafe;
+          ConstantRange Size(APInt(BitWidth, 0), APInt(BitWidth, Len->getZExtValue()));
+          Accessed = Accessed.unionWith(GetOffsetRange(V, Arg).add(Size));
+          continue;
+        }
+
+        ImmutableCallSite::arg_iterator B = CS.arg_begin(), E = CS.arg_end();
+        for (ImmutableCallSite::arg_iterator A = B; A != E; ++A) {
+          if (A->get() != V)
+            continue;
+          if (CS.doesNotCapture(A - B) && (CS.doesNotAccessMemory(A - B) ||
+                                           CS.doesNotAccessMemory()))
+            continue;
+          const ArgSummary *Summary = Summaries ? Summaries->get(CS, A - B) : nullptr;
+          if (!Summary || Summary->Captured)
+            return Unsafe;
+          Accessed = Accessed.unionWith(GetOffsetRange(V, Arg).add(Summary->Accessed));
+        }
+        if (CS.getCalledValue() == V)
+          return Unsafe;
+        continue;
+      }
+
+      default:
+        if (Visited.insert(I).second)
+          WorkList.push_back(cast<const Instruction>(I));
+      }
+    }
+  }
+
+  ArgSummary Summary(BitWidth);
+  Summary.Captured = false;
+  Summary.Accessed = Accessed;
+  return Summary;
+}
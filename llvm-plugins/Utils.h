@@ -7,6 +7,8 @@
 #include <llvm/Analysis/ScalarEvolution.h>
 #include <llvm/Analysis/ScalarEvolutionExpressions.h>
 #include <llvm/IR/Constant.h>
+#include <llvm/IR/ConstantRange.h>
+#include <llvm/IR/CallSite.h>
 
 #include <map>
 #include <set>
@@ -18,13 +20,52 @@ extern llvm::cl::opt<bool> FixedCompression;
 extern llvm::cl::opt<unsigned long> MetadataBytes;
 extern llvm::cl::opt<bool> DeepMetadata;
 extern llvm::cl::opt<unsigned long> DeepMetadataBytes;
+extern llvm::cl::opt<unsigned> PtrBits;
+extern llvm::cl::opt<bool> UseSafetySummaries;
+extern llvm::cl::opt<bool> MaskCSE;
+extern llvm::cl::opt<bool> MaskHoist;
+extern llvm::cl::list<std::string> PerModulePasses;
+
+/* Mask of the address bits of fat pointers (PTR_MASK for -METALLOC_PTRBITS) */
+static inline uint64_t ptrMask() {
+    return ~0ULL >> (64 - PtrBits);
+}
+
+/*
+ * Whether a pointer at Offset from a masked pointer may be used without
+ * masking it again. The offset may carry past bit PTR_BITS, which lands it in
+ * the PROT_NONE page that shrinkaddrspace reserves above the reduced address
+ * space (or below zero). At 46 bits the meta-pagetable starts right at 2^46.
+ */
+static inline bool isDerivableOffset(int64_t Offset) {
+    const int64_t GuardSize = 4096;
+    if (PtrBits >= 46)
+        return false;
+    return Offset > -GuardSize && Offset < GuardSize;
+}
+
+/*
+ * How a function uses one of its pointer arguments: whether the pointer may
+ * escape the function (stored, returned, passed to unknown code) and which
+ * byte offsets from it may be read or written.
+ */
+struct ArgSummary {
+    bool Captured;
+    llvm::ConstantRange Accessed;
+
+    ArgSummary(unsigned BitWidth) : Captured(true), Accessed(BitWidth, true) {}
+};
+
+class SafetySummaries;
 
 class SafetyManager {
 public:
     const llvm::DataLayout *DL;
     llvm::ScalarEvolution *SE;
+    const SafetySummaries *Summaries;
 
-    SafetyManager(const llvm::DataLayout *DL, llvm::ScalarEvolution *SE) : DL(DL), SE(SE) {}
+    SafetyManager(const llvm::DataLayout *DL, llvm::ScalarEvolution *SE,
+                  const SafetySummaries *Summaries = nullptr) : DL(DL), SE(SE), Summaries(Summaries) {}
 
     unsigned long GetStaticAllocaAllocationSize(const llvm::AllocaInst *AI);
     unsigned long GetByvalArgumentSize(const llvm::Argument *Arg);
@@ -34,6 +75,7 @@ public:
     void AccumulateUnsafeSideEffects(const llvm::Value *AllocaPtr, unsigned long AllocaSize,  std::set<std::pair<const llvm::Instruction*, const llvm::Value*> > &UnsafeSideEffects);
     void AccumulateUnsafeSideEffects(const llvm::Function *F, std::map<const llvm::Value*, std::set<std::pair<const llvm::Instruction*, const llvm::Value*> > > &UnsafeSideEffects);
     void AccumulateUnsafeSideEffects(const llvm::Module *M, std::map<const llvm::GlobalValue *, std::set<std::pair<const llvm::Instruction*, const llvm::Value*> > > &UnsafeSideEffects);
+    ArgSummary SummarizeArgument(const llvm::Argument *Arg);
 private:
     bool DoesContainPointer(const llvm::Type *T);
     bool IsAccessSafe(llvm::Value *Addr, unsigned long AccessSize,
@@ -42,6 +84,9 @@ private:
                         const llvm::Value *AllocaPtr,
                         unsigned long AllocaSize);
     void AccumulateSideEffects(const llvm::Value *AllocaPtr, std::set<const llvm::Instruction*> &SideEffects);
+    llvm::ConstantRange GetOffsetRange(const llvm::Value *Addr, const llvm::Value *BasePtr);
+    bool IsCallArgSafe(llvm::ImmutableCallSite CS, unsigned ArgNo, const llvm::Value *V,
+                        const llvm::Value *AllocaPtr, unsigned long AllocaSize);
 };
 
 bool allNonInstructionUsersCanBeMadeInstructions(llvm::Constant *C);
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <metadata.h>
+
+/*
+ * Microbenchmark for the pointer masking sequences emitted by the LLVM
+ * passes, on x86-64. Each variant is a hand-written kernel that performs a
+ * masked memory access the way the backend lowers it:
+ *
+ *   none        unmasked access through a thin pointer (baseline)
+ *   movabs_and  MaskPointers mask with the 64-bit constant materialized per
+ *               access (the constant is not hoisted)
+ *   and         MaskPointers mask with the constant hoisted in a register
+ *   movl        MidFatPtrs mask (and with 0xffffffff, or -midfat-addr32),
+ *               which the backend lowers to a 32-bit register move
+ *   addr32      32-bit effective address through the address-size prefix,
+ *               which needs no separate mask instruction at all
+ *
+ * Two kernels run per variant: chase follows a randomly permuted linked list
+ * of fat pointers (latency, the mask is on the critical path) and sum loads
+ * through an array of fat pointers (throughput). Cycles are TSC cycles per
+ * access; bytes is the code size of the masking sequence plus the access.
+ */
+
+#if !defined(__x86_64__)
+#error "maskbench measures x86-64 instruction sequences"
+#endif
+
+/* mask of MaskPointers: pointer bits plus the overflow bit */
+#define SFI_MASK "0x80000000ffffffff"
+
+#define MASK_NONE(r64, r32)       ""
+#define MASK_MOVABS_AND(r64, r32) "movabs $" SFI_MASK ", %rcx\n and %rcx, " r64 "\n"
+#define MASK_AND(r64, r32)        "and %rcx, " r64 "\n"
+#define MASK_MOVL(r64, r32)       "mov " r32 ", " r32 "\n"
+#define MASK_ADDR32(r64, r32)     ""
+
+#define ADDR_64(r64, r32)         "(" r64 ")"
+#define ADDR_32(r64, r32)         "(" r32 ")"
+
+#define SETUP_NONE                ""
+#define SETUP_SFI_MASK            "movabs $" SFI_MASK ", %rcx\n"
+
+/*
+ * unsigned long chase_<name>(unsigned long ptr, unsigned long count);
+ * unsigned long sum_<name>(unsigned long *ptrs, unsigned long count);
+ */
+#define KERNELS(name, setup, mask, addr)                                    \
+    __asm__(".text\n"                                                       \
+            ".globl chase_" #name "\n"                                      \
+            ".type chase_" #name ", @function\n"                            \
+            "chase_" #name ":\n"                                            \
+            setup                                                           \
+            "1:\n"                                                          \
+            ".globl chase_" #name "_seq\n"                                  \
+            "chase_" #name "_seq:\n"                                        \
+            mask("%rdi", "%edi")                                            \
+            "mov " addr("%rdi", "%edi") ", %rdi\n"                          \
+            ".globl chase_" #name "_seq_end\n"                              \
+            "chase_" #name "_seq_end:\n"                                    \
+            "dec %rsi\n"                                                    \
+            "jnz 1b\n"                                                      \
+            "mov %rdi, %rax\n"                                              \
+            "ret\n"                                                         \
+            ".size chase_" #name ", .-chase_" #name "\n"                    \
+            ".globl sum_" #name "\n"                                        \
+            ".type sum_" #name ", @function\n"                              \
+            "sum_" #name ":\n"                                              \
+            setup                                                           \
+            "xor %eax, %eax\n"                                              \
+            "1:\n"                                                          \
+            "mov (%rdi), %rdx\n"                                            \
+            mask("%rdx", "%edx")                                            \
+            "add " addr("%rdx", "%edx") ", %rax\n"                          \
+            "add $8, %rdi\n"                                                \
+            "dec %rsi\n"                                                    \
+            "jnz 1b\n"                                                      \
+            "ret\n"                                                         \
+            ".size sum_" #name ", .-sum_" #name "\n");                      \
+    unsigned long chase_##name(unsigned long ptr, unsigned long count);     \
+    unsigned long sum_##name(unsigned long *ptrs, unsigned long count);     \
+    extern const char chase_##name##_seq[], chase_##name##_seq_end[];
+
+KERNELS(none,       SETUP_NONE,     MASK_NONE,       ADDR_64)
+KERNELS(movabs_and, SETUP_NONE,     MASK_MOVABS_AND, ADDR_64)
+KERNELS(and,        SETUP_SFI_MASK, MASK_AND,        ADDR_64)
+KERNELS(movl,       SETUP_NONE,     MASK_MOVL,       ADDR_64)
+KERNELS(addr32,     SETUP_NONE,     MASK_ADDR32,     ADDR_32)
+
+struct variant {
+    const char *name;
+    int fat;
+    unsigned long (*chase)(unsigned long ptr, unsigned long count);
+    unsigned long (*sum)(unsigned long *ptrs, unsigned long count);
+    const char *seq;
+    const char *seq_end;
+};
+
+#define VARIANT(name, fat) \
+    { #name, fat, chase_##name, sum_##name, chase_##name##_seq, chase_##name##_seq_end }
+
+static const struct variant variants[] = {
+    VARIANT(none, 0),
+    VARIANT(movabs_and, 1),
+    VARIANT(and, 1),
+    VARIANT(movl, 1),
+    VARIANT(addr32, 1),
+};
+
+#define NVARIANTS (sizeof(variants) / sizeof(variants[0]))
+#define SLOTSIZE 64
+
+/* arbitrary metadata pointer in the high bits, with the overflow bit clear */
+#define FATTAG (0x12345678ULL << PTR_BITS)
+
+static unsigned long region_size = 1UL << 20; /* L2-resident */
+static unsigned long ops = 1UL << 24;
+static unsigned long *slots;
+static unsigned long *ptrs;
+static unsigned long nslots;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void setup(void) {
+    /* addr32 truncates effective addresses, so stay below 4 GiB */
+    slots = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("maskbench: mmap failed");
+        exit(-1);
+    }
+    nslots = region_size / SLOTSIZE;
+    ptrs = malloc(nslots * sizeof(unsigned long));
+    if (!ptrs) {
+        perror("maskbench: malloc failed");
+        exit(-1);
+    }
+}
+
+/* link all slots in one random cycle, with fat or thin pointers */
+static unsigned long build_list(int fat) {
+    unsigned long *order = malloc(nslots * sizeof(unsigned long));
+    unsigned long stride = SLOTSIZE / sizeof(unsigned long);
+    unsigned long tag = fat ? FATTAG : 0;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+    for (unsigned long i = 0; i < nslots; ++i)
+        order[i] = i;
+    for (unsigned long i = nslots - 1; i > 0; --i) {
+        unsigned long j = xorshift(&state) % (i + 1);
+        unsigned long tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (unsigned long i = 0; i < nslots; ++i) {
+        unsigned long next = order[(i + 1) % nslots];
+        slots[order[i] * stride] = (unsigned long)&slots[next * stride] | tag;
+        ptrs[i] = (unsigned long)&slots[order[i] * stride] | tag;
+    }
+
+    unsigned long head = (unsigned long)&slots[order[0] * stride] | tag;
+    free(order);
+    return head;
+}
+
+static void report(const struct variant *v, const char *kernel,
+                   uint64_t cycles, double seconds, unsigned long n) {
+    printf("%s\t%s\t%.2f\t%.3f\t%ld\n", v->name, kernel,
+           (double)cycles / n, seconds * 1e9 / n, (long)(v->seq_end - v->seq));
+}
+
+static void run(const struct variant *v) {
+    unsigned long head = build_list(v->fat);
+    unsigned long rounds = ops / nslots ? ops / nslots : 1;
+    volatile unsigned long sink;
+
+    /* warm up caches and TLB */
+    sink = v->chase(head, nslots);
+
+    double start = now();
+    uint64_t tsc = __rdtsc();
+    sink = v->chase(head, rounds * nslots);
+    uint64_t cycles = __rdtsc() - tsc;
+    report(v, "chase", cycles, now() - start, rounds * nslots);
+
+    sink = v->sum(ptrs, nslots);
+    start = now();
+    tsc = __rdtsc();
+    for (unsigned long r = 0; r < rounds; ++r)
+        sink = v->sum(ptrs, nslots);
+    cycles = __rdtsc() - tsc;
+    report(v, "sum", cycles, now() - start, rounds * nslots);
+    (void)sink;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-v variants] [-n ops] [-s region MiB]\n", argv0);
+    fprintf(stderr, "  variants: none,movabs_and,and,movl,addr32\n");
+}
+
+int main(int argc, char **argv) {
+    char *selected = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:s:v:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            region_size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        case 'v':
+            selected = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    setup();
+    printf("variant\tkernel\tcycles/access\tns/access\tbytes\n");
+    for (unsigned long i = 0; i < NVARIANTS; ++i) {
+        if (selected) {
+            /* match whole names in the comma-separated list */
+            size_t len = strlen(variants[i].name);
+            const char *p = selected;
+            int found = 0;
+            while ((p = strstr(p, variants[i].name))) {
+                if ((p == selected || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+                    found = 1;
+                p += len;
+            }
+            if (!found)
+                continue;
+        }
+        run(&variants[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,732 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <metadata.h>
+#include <metapagetable.h>
+
+/*
+ * Microbenchmarks for the metadata runtime (staticlib and metapagetable).
+ *
+ * The binary is built once per metapagetable configuration (see Makefile),
+ * so the metadata size, deep metadata and fixed compression settings are
+ * compile-time constants here, exactly as they are for instrumented programs.
+ * Each benchmark runs over a set of precomputed addresses following one of
+ * the locality patterns below, either as a dependent chain (latency, the next
+ * address depends on the metadata just read) or as independent lookups
+ * (throughput), on one or more threads.
+ */
+
+#ifndef CONFIG_NAME
+#define CONFIG_NAME "default"
+#endif
+
+#define CAT_INTERNAL(a, b) a##b
+#define CAT(a, b) CAT_INTERNAL(a, b)
+
+#define METABYTES FLAGS_METALLOC_METADATABYTES
+#define metatype CAT(meta, METABYTES)
+
+#if METABYTES == 16
+#define META_LOW(m) ((m).a)
+static inline meta16 META_MAKE(uint64_t v) { meta16 m = { v, 0 }; return m; }
+#else
+#define META_LOW(m) ((uint64_t)(m))
+#define META_MAKE(v) ((metatype)(v))
+#endif
+
+/* runtime functions from staticlib, which has no header for them */
+metatype CAT(metaget_, METABYTES)(unsigned long ptrInt);
+unsigned long CAT(metaset_alignment_, METABYTES)(unsigned long ptrInt,
+        unsigned long count, metatype value, unsigned long alignment);
+unsigned long CAT(metaset_fixed_, METABYTES)(unsigned long ptrInt,
+        unsigned long count, metatype value);
+meta8 metaget_deep_8(unsigned long ptrInt);
+meta8 metaget_base_deep_8(unsigned long ptrInt, unsigned long entry,
+        unsigned long oldPtrInt);
+unsigned long metabaseget(unsigned long ptrInt);
+#if METABYTES <= 8
+metatype CAT(metaget_fixed_, METABYTES)(unsigned long ptrInt);
+metatype CAT(metaget_base_, METABYTES)(unsigned long ptrInt,
+        unsigned long entry, unsigned long oldPtrInt);
+void CAT(metacheck_, METABYTES)(metatype metadata, metatype value);
+#endif
+/* 8-byte bounds hold 32-bit addresses */
+#if METABYTES == 16 || (METABYTES == 8 && PTR_BITS == 32)
+#define HAVE_BOUNDSCHECK 1
+void CAT(boundscheck_, METABYTES)(unsigned long ptrInt, unsigned long accessSize);
+#else
+#define HAVE_BOUNDSCHECK 0
+#endif
+void bounds_alloc_hook(void *ptr, void *deepmetadata, unsigned long content_size,
+        unsigned long allocation_size);
+
+#define OBJECTSIZE 64
+#define MAXTHREADS 256
+
+/*
+ * C equivalent of the metaptr MidFatPtrs puts in allocated pointers: the
+ * lookup_metaptr helper, followed by the load of the deep metadata object
+ */
+static inline unsigned long lookup_metaptr(unsigned long ptrInt) {
+    unsigned long page = ptrInt / METALLOC_PAGESIZE;
+    unsigned long entry = pageTable[page];
+    unsigned long alignment = entry & 0xff;
+    unsigned long metabase = entry >> 8;
+    unsigned long pageOffset = ptrInt - page * METALLOC_PAGESIZE;
+    unsigned long slot = FLAGS_METALLOC_DEEPMETADATA ? sizeof(unsigned long) : METABYTES;
+    unsigned long metaptr = metabase + (pageOffset >> alignment) * slot;
+    if (FLAGS_METALLOC_DEEPMETADATA)
+        metaptr = *(unsigned long*)metaptr;
+    return metaptr;
+}
+
+enum pattern { PATTERN_SEQ, PATTERN_PAGE, PATTERN_RANDOM, PATTERN_COUNT };
+static const char *pattern_names[] = { "seq", "page", "random" };
+
+enum bench {
+    BENCH_METAGET, BENCH_METAGET_BASE, BENCH_METASET, BENCH_METACHECK,
+    BENCH_BOUNDSCHECK, BENCH_LOOKUP, BENCH_SET_ENTRIES, BENCH_STACK_SETUP,
+    BENCH_THREAD_CREATE, BENCH_COUNT
+};
+static const char *bench_names[] = {
+    "metaget", "metaget_base", "metaset", "metacheck", "boundscheck",
+    "lookup_metaptr", "set_metapagetable_entries", "stack_setup",
+    "pthread_create"
+};
+
+struct thread_args {
+    enum bench bench;
+    int latency;
+    unsigned long *addrs;
+    unsigned long count;
+    unsigned long iterations;
+    pthread_barrier_t *barrier;
+    double start;
+    double end;
+    uint64_t sink;
+};
+
+static unsigned long region_size = 64UL << 20;
+static unsigned long alignment = GLOBALALIGN;
+static unsigned long ops = 1UL << 22;
+static char *region;
+static char *metadata;
+static unsigned long *deepmetadata;
+
+/*
+ * The value every metadata slot is set to, and a mask that is always zero.
+ * Both are hidden from the optimizer so that latency runs can make the next
+ * address depend on the metadata just read without changing the address.
+ */
+static volatile uint64_t metavalue_volatile = 0x5a;
+static volatile uint64_t depmask_volatile = 0;
+static uint64_t metavalue;
+static uint64_t depmask;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *map_low(unsigned long size) {
+    /* fat pointers keep the metadata pointer in 32 bits, so stay below 4 GiB */
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("metabench: mmap failed");
+        exit(-1);
+    }
+    return ptr;
+}
+
+#ifdef MIDFAT_POINTERS
+/* high bits of a fat pointer into the region */
+static unsigned long metaptr_for(unsigned long ptrInt) {
+    unsigned long slot = FLAGS_METALLOC_DEEPMETADATA ? sizeof(unsigned long) : METABYTES;
+    unsigned long metaptr = (unsigned long)metadata + ((ptrInt - (unsigned long)region) >> alignment) * slot;
+    if (FLAGS_METALLOC_DEEPMETADATA)
+        return METAPTR_ENCODE(*(unsigned long*)metaptr, DEEPMETA_ALIGN);
+    return METAPTR_ENCODE(metaptr, slot);
+}
+#endif
+
+static void fill_region_metadata(void) {
+    unsigned long granules = region_size >> alignment;
+    for (unsigned long i = 0; i < granules; ++i)
+        ((metatype*)metadata)[i] = META_MAKE(metavalue);
+}
+
+static void setup_region(void) {
+    region = map_low(region_size);
+    memset(region, 0, region_size);
+    if (FLAGS_METALLOC_FIXEDCOMPRESSION) {
+        page_table_init();
+        for (unsigned long off = 0; off < region_size; off += METALLOC_PAGESIZE)
+            CAT(metaset_fixed_, METABYTES)((unsigned long)region + off,
+                    METALLOC_PAGESIZE, META_MAKE(metavalue));
+        return;
+    }
+
+    unsigned long granules = region_size >> alignment;
+#if PTR_BITS > 32
+    /* fat pointers refer to metadata in the arena */
+    metadata = allocate_metadata(region_size, alignment);
+#else
+    unsigned long slot = FLAGS_METALLOC_DEEPMETADATA ? sizeof(unsigned long) : METABYTES;
+    metadata = map_low(granules * slot);
+#endif
+    set_metapagetable_entries(region, region_size, metadata, alignment);
+    if (FLAGS_METALLOC_DEEPMETADATA) {
+        /* one deep metadata object per allocation-sized object */
+        unsigned long objects = region_size / OBJECTSIZE;
+#if PTR_BITS > 32
+        deepmetadata = allocate_metadata_arena(objects * FLAGS_METALLOC_DEEPMETADATABYTES);
+        if (!deepmetadata) {
+            fprintf(stderr, "metabench: metadata arena exhausted\n");
+            exit(-1);
+        }
+#else
+        deepmetadata = map_low(objects * FLAGS_METALLOC_DEEPMETADATABYTES);
+#endif
+        for (unsigned long i = 0; i < granules; ++i) {
+            unsigned long object = (i << alignment) / OBJECTSIZE;
+            unsigned long *deep = deepmetadata + object *
+                    (FLAGS_METALLOC_DEEPMETADATABYTES / sizeof(unsigned long));
+            deep[0] = metavalue;
+            ((unsigned long*)metadata)[i] = (unsigned long)deep;
+        }
+    } else {
+        fill_region_metadata();
+    }
+}
+
+/*
+ * Bounds of OBJECTSIZE-sized objects (or granules, if larger), as tcmalloc
+ * sets them with the bounds hook, for boundscheck. The other benchmarks
+ * expect metavalue, which fill_region_metadata restores.
+ */
+static void set_region_bounds(void) {
+    unsigned long objectsize = OBJECTSIZE > (1UL << alignment) ?
+        OBJECTSIZE : 1UL << alignment;
+    for (unsigned long off = 0; off < region_size; off += objectsize)
+        bounds_alloc_hook(region + off, NULL, objectsize, objectsize);
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* generate count addresses in [start, start+size) following the pattern */
+static unsigned long *make_addrs(enum pattern pattern, char *start,
+                                 unsigned long size, unsigned long count,
+                                 uint64_t seed) {
+    unsigned long *addrs = malloc(count * sizeof(unsigned long));
+    unsigned long granule = 1UL << alignment;
+    unsigned long granules = size / granule;
+    unsigned long pages = size / METALLOC_PAGESIZE;
+    uint64_t state = seed | 1;
+    if (!addrs) {
+        perror("metabench: malloc failed");
+        exit(-1);
+    }
+    for (unsigned long i = 0; i < count; ++i) {
+        unsigned long offset;
+        switch (pattern) {
+        case PATTERN_SEQ:
+            offset = (i % granules) * granule;
+            break;
+        case PATTERN_PAGE:
+            /* one access per page, so every access needs a new pagetable entry */
+            offset = (i % pages) * METALLOC_PAGESIZE +
+                     ((i / pages) * granule) % METALLOC_PAGESIZE;
+            break;
+        default:
+            offset = (xorshift(&state) % granules) * granule;
+            break;
+        }
+        unsigned long ptrInt = (unsigned long)start + offset;
+#ifdef MIDFAT_POINTERS
+        if (!FLAGS_METALLOC_FIXEDCOMPRESSION)
+            ptrInt |= metaptr_for(ptrInt) << PTR_BITS;
+#endif
+        addrs[i] = ptrInt;
+    }
+    return addrs;
+}
+
+static inline metatype do_metaget(unsigned long ptrInt) {
+    if (FLAGS_METALLOC_FIXEDCOMPRESSION) {
+#if METABYTES <= 8
+        return CAT(metaget_fixed_, METABYTES)(ptrInt);
+#endif
+    }
+#if METABYTES == 8
+    if (FLAGS_METALLOC_DEEPMETADATA)
+        return metaget_deep_8(ptrInt);
+#endif
+    return CAT(metaget_, METABYTES)(ptrInt);
+}
+
+#if METABYTES <= 8
+static inline metatype do_metaget_base(unsigned long ptrInt, unsigned long entry,
+                                       unsigned long oldPtrInt) {
+#if METABYTES == 8
+    if (FLAGS_METALLOC_DEEPMETADATA)
+        return metaget_base_deep_8(ptrInt, entry, oldPtrInt);
+#endif
+    return CAT(metaget_base_, METABYTES)(ptrInt, entry, oldPtrInt);
+}
+#endif
+
+static void run_metaget(struct thread_args *args) {
+    unsigned long *addrs = args->addrs;
+    unsigned long mask = args->count - 1;
+    uint64_t sink = 0, dep = 0;
+    for (unsigned long i = 0; i < args->iterations; ++i) {
+        metatype m = do_metaget(addrs[i & mask] + dep);
+        if (args->latency)
+            dep = META_LOW(m) & depmask;
+        else
+            sink += META_LOW(m);
+    }
+    args->sink = sink + dep;
+}
+
+static void run_metaget_base(struct thread_args *args) {
+#if METABYTES <= 8
+    /* fetch the pagetable entry once per object, then access each granule */
+    unsigned long *addrs = args->addrs;
+    unsigned long mask = args->count - 1;
+    unsigned long perobject = OBJECTSIZE >> alignment;
+    uint64_t sink = 0, dep = 0;
+    if (perobject == 0)
+        perobject = 1;
+    for (unsigned long i = 0; i < args->iterations; i += perobject) {
+        unsigned long base = ((addrs[i & mask] & PTR_MASK) & ~(unsigned long)(OBJECTSIZE - 1)) + dep;
+        unsigned long entry = metabaseget(base);
+        for (unsigned long j = 0; j < perobject; ++j) {
+            metatype m = do_metaget_base(base + (j << alignment), entry, base);
+            if (args->latency)
+                dep = META_LOW(m) & depmask;
+            else
+                sink += META_LOW(m);
+        }
+    }
+    args->sink = sink + dep;
+#endif
+}
+
+static void run_metaset(struct thread_args *args) {
+    /* set the metadata for an OBJECTSIZE-sized object, as the allocator hooks do */
+    unsigned long *addrs = args->addrs;
+    unsigned long mask = args->count - 1;
+    metatype value = META_MAKE(metavalue);
+    uint64_t sink = 0;
+    if (FLAGS_METALLOC_DEEPMETADATA)
+        value = META_MAKE((unsigned long)deepmetadata);
+    for (unsigned long i = 0; i < args->iterations; ++i) {
+        unsigned long ptrInt = (addrs[i & mask] & PTR_MASK) & ~(unsigned long)(OBJECTSIZE - 1);
+        if (FLAGS_METALLOC_FIXEDCOMPRESSION)
+            sink += CAT(metaset_fixed_, METABYTES)(ptrInt, OBJECTSIZE, value);
+        else
+            sink += CAT(metaset_alignment_, METABYTES)(ptrInt, OBJECTSIZE, value, alignment);
+    }
+    args->sink = sink;
+}
+
+static void run_metacheck(struct thread_args *args) {
+#if METABYTES <= 8
+    /* the sequence DummyPass inserts after every store */
+    unsigned long *addrs = args->addrs;
+    unsigned long mask = args->count - 1;
+    metatype value = META_MAKE(metavalue);
+    uint64_t dep = 0;
+    for (unsigned long i = 0; i < args->iterations; ++i) {
+        metatype m = do_metaget(addrs[i & mask] + dep);
+        CAT(metacheck_, METABYTES)(m, value);
+        if (args->latency)
+            dep = META_LOW(m) & depmask;
+    }
+    args->sink = dep;
+#endif
+}
+
+static void run_boundscheck(struct thread_args *args) {
+#if HAVE_BOUNDSCHECK
+    /* the check BoundsChecks inserts before every heap access */
+    unsigned long *addrs = args->addrs;
+    unsigned long mask = args->count - 1;
+    for (unsigned long i = 0; i < args->iterations; ++i)
+        CAT(boundscheck_, METABYTES)(addrs[i & mask], sizeof(unsigned long));
+    args->sink = 0;
+#endif
+}
+
+static void run_lookup(struct thread_args *args) {
+    unsigned long *addrs = args->addrs;
+    unsigned long mask = args->count - 1;
+    uint64_t sink = 0, dep = 0;
+    for (unsigned long i = 0; i < args->iterations; ++i) {
+        unsigned long metaptr = lookup_metaptr((addrs[i & mask] & PTR_MASK) + dep);
+        if (args->latency)
+            dep = metaptr & depmask;
+        else
+            sink += metaptr;
+    }
+    args->sink = sink + dep;
+}
+
+static int bench_supported(enum bench bench) {
+    switch (bench) {
+    case BENCH_METAGET_BASE:
+    case BENCH_LOOKUP:
+        return !FLAGS_METALLOC_FIXEDCOMPRESSION && METABYTES <= 8;
+    case BENCH_METACHECK:
+        return METABYTES <= 8;
+    case BENCH_BOUNDSCHECK:
+        return !FLAGS_METALLOC_FIXEDCOMPRESSION && !FLAGS_METALLOC_DEEPMETADATA &&
+            HAVE_BOUNDSCHECK;
+    case BENCH_SET_ENTRIES:
+    case BENCH_STACK_SETUP:
+    case BENCH_THREAD_CREATE:
+        return !FLAGS_METALLOC_FIXEDCOMPRESSION;
+    default:
+        return 1;
+    }
+}
+
+static void *thread_main(void *arg) {
+    struct thread_args *args = arg;
+    pthread_barrier_wait(args->barrier);
+    args->start = now();
+    switch (args->bench) {
+    case BENCH_METAGET:      run_metaget(args); break;
+    case BENCH_METAGET_BASE: run_metaget_base(args); break;
+    case BENCH_METASET:      run_metaset(args); break;
+    case BENCH_METACHECK:    run_metacheck(args); break;
+    case BENCH_BOUNDSCHECK:  run_boundscheck(args); break;
+    case BENCH_LOOKUP:       run_lookup(args); break;
+    default: break;
+    }
+    args->end = now();
+    return NULL;
+}
+
+static void run_bench(enum bench bench, enum pattern pattern, int latency,
+                      int threads) {
+    struct thread_args args[MAXTHREADS];
+    pthread_t tids[MAXTHREADS];
+    pthread_barrier_t barrier;
+    unsigned long slice = (region_size / threads) & ~(unsigned long)(METALLOC_PAGESIZE - 1);
+    unsigned long count = 1UL << 20;
+    double start = 0, end = 0;
+
+    /* metaset writes, so give each thread its own part of the region */
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (int t = 0; t < threads; ++t) {
+        args[t].bench = bench;
+        args[t].latency = latency;
+        args[t].addrs = make_addrs(pattern, region + t * slice, slice, count, t + 1);
+        args[t].count = count;
+        args[t].iterations = ops;
+        args[t].barrier = &barrier;
+        if (pthread_create(&tids[t], NULL, thread_main, &args[t]) != 0) {
+            perror("metabench: pthread_create failed");
+            exit(-1);
+        }
+    }
+    pthread_barrier_wait(&barrier);
+
+    /* wall time from the first thread starting to the last one finishing */
+    for (int t = 0; t < threads; ++t) {
+        pthread_join(tids[t], NULL);
+        if (t == 0 || args[t].start < start)
+            start = args[t].start;
+        if (t == 0 || args[t].end > end)
+            end = args[t].end;
+        free(args[t].addrs);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    double elapsed = end - start;
+    double total = (double)ops * threads;
+    printf("%s\t%s\t%s\t%s\t%d\t%.2f\t%.1f\n", CONFIG_NAME,
+           bench_names[bench], pattern_names[pattern],
+           latency ? "latency" : "throughput", threads,
+           elapsed * 1e9 * threads / total, total / elapsed / 1e6);
+    fflush(stdout);
+}
+
+static void run_set_entries(void) {
+    /* what the tcmalloc hooks and initialize_metadata pay per mapping */
+    unsigned long sizes[] = { 64UL << 10, 1UL << 20, 16UL << 20, region_size };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        unsigned long size = sizes[i];
+        unsigned long repeat = (256UL << 20) / size;
+        if (size > region_size || (i > 0 && size == sizes[i - 1]))
+            continue;
+        if (repeat == 0)
+            repeat = 1;
+        double start = now();
+        for (unsigned long r = 0; r < repeat; ++r)
+            set_metapagetable_entries(region, size, metadata, alignment);
+        double elapsed = now() - start;
+        printf("%s\tset_metapagetable_entries\t%luK\tcall\t1\t%.2f\t%.1f\n",
+               CONFIG_NAME, size >> 10, elapsed * 1e9 / repeat,
+               repeat * (size / METALLOC_PAGESIZE) / elapsed / 1e6);
+    }
+}
+
+/*
+ * Stack metadata as set up by initialize_global_metadata and the unsafe stack
+ * hooks: eagerly, writing the pagetable entries of the whole stack, or lazily,
+ * registering the stack and resolving the entries of the used top on lookup.
+ */
+enum stack_mode { STACK_NONE, STACK_EAGER, STACK_LAZY, STACK_MODE_COUNT };
+static const char *stack_mode_names[] = { "none", "eager", "lazy" };
+
+/* bytes of stack a short-lived thread uses */
+#define STACK_USED (16UL << 10)
+
+static char *map_stack(unsigned long size) {
+    char *stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        perror("metabench: mmap failed");
+        exit(-1);
+    }
+    return stack;
+}
+
+static void stack_setup(char *stack, unsigned long size, enum stack_mode mode) {
+    switch (mode) {
+    case STACK_EAGER:
+        set_metapagetable_entries(stack, size, allocate_metadata(size, STACKALIGN), STACKALIGN);
+        break;
+    case STACK_LAZY:
+        if (!register_lazy_metadata_region(stack, size, STACKALIGN)) {
+            fprintf(stderr, "metabench: out of lazy metadata regions\n");
+            exit(-1);
+        }
+        break;
+    default:
+        break;
+    }
+    /* the first lookups, at the top of the stack */
+    if (mode != STACK_NONE) {
+        for (unsigned long off = METALLOC_PAGESIZE; off <= STACK_USED; off += METALLOC_PAGESIZE)
+            get_metapagetable_entry(stack + size - off);
+    }
+}
+
+static void stack_teardown(char *stack, unsigned long size, enum stack_mode mode) {
+    switch (mode) {
+    case STACK_EAGER:
+        deallocate_metadata(stack, size, STACKALIGN);
+        set_metapagetable_entries(stack, size, 0, 0);
+        break;
+    case STACK_LAZY:
+        unregister_lazy_metadata_region(stack);
+        break;
+    default:
+        break;
+    }
+}
+
+static void run_stack_setup(void) {
+    /* thread stacks up to the main stack under a large RLIMIT_STACK */
+    unsigned long sizes[] = { 64UL << 10, 1UL << 20, 8UL << 20, 64UL << 20, 1UL << 30 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        unsigned long size = sizes[i];
+        unsigned long repeat = (1UL << 30) / size;
+        char *stack = map_stack(size);
+        if (repeat > 4096)
+            repeat = 4096;
+        for (int mode = STACK_EAGER; mode < STACK_MODE_COUNT; ++mode) {
+            double start = now();
+            for (unsigned long r = 0; r < repeat; ++r) {
+                stack_setup(stack, size, mode);
+                stack_teardown(stack, size, mode);
+            }
+            double elapsed = now() - start;
+            printf("%s\tstack_setup\t%luK\t%s\t1\t%.2f\t%.1f\n",
+                   CONFIG_NAME, size >> 10, stack_mode_names[mode],
+                   elapsed * 1e9 / repeat, repeat / elapsed / 1e6);
+        }
+        munmap(stack, size);
+    }
+}
+
+struct stack_thread_args {
+    unsigned long size;
+    enum stack_mode mode;
+};
+
+static void *stack_thread_main(void *arg) {
+    struct stack_thread_args *args = arg;
+    char *stack = map_stack(args->size);
+    stack_setup(stack, args->size, args->mode);
+    stack_teardown(stack, args->size, args->mode);
+    munmap(stack, args->size);
+    return NULL;
+}
+
+static void run_thread_create(void) {
+    /* the separate stack that each thread gets under SafeStack */
+    unsigned long sizes[] = { 8UL << 20, 64UL << 20 };
+    unsigned long repeat = 2000;
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (int mode = STACK_NONE; mode < STACK_MODE_COUNT; ++mode) {
+            struct stack_thread_args args = { sizes[i], mode };
+            double start = now();
+            for (unsigned long r = 0; r < repeat; ++r) {
+                pthread_t tid;
+                if (pthread_create(&tid, NULL, stack_thread_main, &args) != 0) {
+                    perror("metabench: pthread_create failed");
+                    exit(-1);
+                }
+                pthread_join(tid, NULL);
+            }
+            double elapsed = now() - start;
+            printf("%s\tpthread_create\t%luK\t%s\t1\t%.2f\t%.3f\n",
+                   CONFIG_NAME, sizes[i] >> 10, stack_mode_names[mode],
+                   elapsed * 1e9 / repeat, repeat / elapsed / 1e6);
+        }
+    }
+}
+
+static int parse_list(const char *arg, const char **names, int count, int *enabled) {
+    char *copy = strdup(arg), *save = NULL;
+    for (int i = 0; i < count; ++i)
+        enabled[i] = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int found = 0;
+        for (int i = 0; i < count; ++i) {
+            if (strcmp(tok, names[i]) == 0) {
+                enabled[i] = 1;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "metabench: unknown name %s\n", tok);
+            return -1;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-b benchmarks] [-p patterns] [-t threads] "
+                    "[-n ops] [-s region MiB] [-a alignment]\n", argv0);
+    fprintf(stderr, "  benchmarks: metaget,metaget_base,metaset,metacheck,"
+                    "boundscheck,lookup_metaptr,\n"
+                    "              set_metapagetable_entries,stack_setup,"
+                    "pthread_create\n");
+    fprintf(stderr, "  patterns:   seq,page,random\n");
+    fprintf(stderr, "  threads:    comma-separated thread counts, e.g. 1,2,4\n");
+}
+
+int main(int argc, char **argv) {
+    int benches[BENCH_COUNT], patterns[PATTERN_COUNT];
+    char *threadlist = "1";
+    int opt;
+
+    for (int i = 0; i < BENCH_COUNT; ++i)
+        benches[i] = 1;
+    for (int i = 0; i < PATTERN_COUNT; ++i)
+        patterns[i] = 1;
+
+    while ((opt = getopt(argc, argv, "a:b:hn:p:s:t:")) != -1) {
+        switch (opt) {
+        case 'a':
+            alignment = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            if (parse_list(optarg, bench_names, BENCH_COUNT, benches))
+                return -1;
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            if (parse_list(optarg, pattern_names, PATTERN_COUNT, patterns))
+                return -1;
+            break;
+        case 's':
+            region_size = strtoul(optarg, NULL, 0) << 20;
+            break;
+        case 't':
+            threadlist = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (alignment < 3 || alignment > METALLOC_PAGESHIFT || region_size < (1UL << 20)) {
+        fprintf(stderr, "metabench: alignment must be 3-%d and the region at least 1 MiB\n",
+                METALLOC_PAGESHIFT);
+        return -1;
+    }
+
+    metavalue = metavalue_volatile;
+    depmask = depmask_volatile;
+    setup_region();
+
+    printf("config\tbenchmark\tpattern\tmode\tthreads\tns/op\tMops/s\n");
+    for (int b = 0; b < BENCH_COUNT; ++b) {
+        if (!benches[b] || !bench_supported(b))
+            continue;
+        if (b == BENCH_SET_ENTRIES) {
+            run_set_entries();
+            continue;
+        }
+        if (b == BENCH_STACK_SETUP) {
+            run_stack_setup();
+            continue;
+        }
+        if (b == BENCH_THREAD_CREATE) {
+            run_thread_create();
+            continue;
+        }
+        if (b == BENCH_BOUNDSCHECK)
+            set_region_bounds();
+        for (int p = 0; p < PATTERN_COUNT; ++p) {
+            if (!patterns[p])
+                continue;
+            for (int latency = 1; latency >= 0; --latency) {
+                /* metaset and boundscheck have no result to chain on */
+                if (latency && (b == BENCH_METASET || b == BENCH_BOUNDSCHECK))
+                    continue;
+                char *copy = strdup(threadlist), *save = NULL;
+                for (char *tok = strtok_r(copy, ",", &save); tok;
+                     tok = strtok_r(NULL, ",", &save)) {
+                    int threads = atoi(tok);
+                    if (threads < 1 || threads > MAXTHREADS) {
+                        fprintf(stderr, "metabench: bad thread count %s\n", tok);
+                        return -1;
+                    }
+                    run_bench(b, p, latency, threads);
+                }
+                free(copy);
+            }
+        }
+        if (b == BENCH_BOUNDSCHECK)
+            fill_region_metadata();
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# Build and run metabench for every supported metapagetable configuration.
+# Arguments are passed on to metabench, e.g.:
+#
+#     ./run.sh -t 1,2,4 -p seq,random
+#
+# Set CONFIGS to a space-separated subset of the names below to limit the
+# configurations; output is tab-separated with one line per measurement.
+
+set -e
+
+cd "$(dirname "$0")"
+
+: ${CONFIGS:="meta1 meta2 meta4 meta8 meta16 deep8 fixed1 midfat8 midfat16"}
+
+config_options() {
+    case "$1" in
+        meta*)   echo "METADATABYTES=${1#meta}";;
+        deep*)   echo "METADATABYTES=${1#deep} DEEPMETADATA=1";;
+        fixed*)  echo "METADATABYTES=${1#fixed} FIXEDCOMPRESSION=1";;
+        midfat*) echo "METADATABYTES=${1#midfat} MIDFAT_POINTERS=1";;
+        *)       echo "unknown configuration $1" >&2; exit 1;;
+    esac
+}
+
+header=1
+for config in $CONFIGS; do
+    options="$(config_options "$config")"
+    make -s OBJDIR="obj/$config" CONFIG_NAME="$config" $options >&2
+    if [ "$header" -eq 1 ]; then
+        "obj/$config/metabench" "$@"
+        header=0
+    else
+        "obj/$config/metabench" "$@" | tail -n +2
+    fi
+done
@@ -0,0 +1,49 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <metapagetable.h>
+
+/*
+ * Allocation hooks for bounds checking (staticlib/boundscheck.c), selected
+ * with ALLOC_HOOK=bounds_alloc_hook RESIZE_HOOK=bounds_resize_hook.
+ *
+ * Every metadata slot of an allocation holds the bounds of its contents. With
+ * 16-byte metadata these are the base and end addresses. With 8-byte metadata
+ * the base is in the low and the end in the high half, which only works for
+ * addresses below 4 GiB (PTRBITS=32); allocations above that are left
+ * unchecked. An end of zero means that the bounds are unknown.
+ */
+
+static void set_bounds(void *ptr, unsigned long allocation_size,
+        unsigned long base, unsigned long end) {
+    if (FLAGS_METALLOC_FIXEDCOMPRESSION || FLAGS_METALLOC_DEEPMETADATA)
+        __builtin_trap();
+
+    unsigned long page = (unsigned long)ptr / METALLOC_PAGESIZE;
+    unsigned long entry = pageTable[page];
+    unsigned long alignment = entry & 0xFF;
+    char *metabase = (char*)(entry >> 8);
+    char *metaptr = metabase + ((((unsigned long)ptr - (page * METALLOC_PAGESIZE)) >> alignment) * FLAGS_METALLOC_METADATABYTES);
+    unsigned long metasize = ((allocation_size + (1 << (alignment)) - 1) >> alignment);
+
+    if (FLAGS_METALLOC_METADATABYTES == 16) {
+        for (unsigned long i = 0; i < metasize; ++i) {
+            ((uint64_t*)metaptr)[2 * i] = base;
+            ((uint64_t*)metaptr)[2 * i + 1] = end;
+        }
+    } else if (FLAGS_METALLOC_METADATABYTES == 8) {
+        uint64_t bounds = end <= (1UL << 32) ? base | (end << 32) : 0;
+        for (unsigned long i = 0; i < metasize; ++i)
+            ((uint64_t*)metaptr)[i] = bounds;
+    } else {
+        __builtin_trap();
+    }
+}
+
+void bounds_alloc_hook(void *ptr, void *deepmetadata, unsigned long content_size, unsigned long allocation_size) {
+    set_bounds(ptr, allocation_size, (unsigned long)ptr, (unsigned long)ptr + content_size);
+}
+
+/* realloc within the same allocation */
+void bounds_resize_hook(void *ptr, unsigned long content_size, unsigned long allocation_size) {
+    set_bounds(ptr, allocation_size, (unsigned long)ptr, (unsigned long)ptr + content_size);
+}
@@ -22,6 +22,12 @@ else ()
     endif ()
 endif ()
 
+if (NOT DEFINED PTRBITS)
+    set(PTRBITS 32)
+elseif (PTRBITS LESS 32 OR PTRBITS GREATER 37)
+    message(FATAL_ERROR "Fat pointers need between 32 and 37 address bits, above which the metadata arena cannot describe the address space")
+endif ()
+
 if (NOT DEFINED ALLOC_SIZE_HOOK)
     set(ALLOC_SIZE_HOOK_ENABLED 0)
 else ()
@@ -13,6 +13,12 @@
 #else
 #define PAGETABLESIZE (((unsigned long)1 << 48) / ((METALLOC_FIXEDSIZE / FLAGS_METALLOC_METADATABYTES) * 16))
 #endif
+// Size of the metadata arena (one slot per value of the high bits of fat pointers, except the overflow bit)
+#define METADATAARENASIZE (((unsigned long)1 << (63 - FLAGS_METALLOC_PTRBITS)) * FLAGS_METALLOC_METADATABYTES)
+// Number of arena chunk sizes (powers of two pages)
+#define METADATAARENACLASSES 48
+// Size of the arena chunks that deep metadata objects are carved from
+#define DEEPMETADATACHUNKSIZE ((unsigned long)SYSTEM_PAGESIZE * 16)
 // Number of pagetable pages covered by each reftable entry
 #define PTPAGESPERREFENTRY 1
 // Size of the reftable (one entry per PAGESPERREFENTRY pages in the pagetable)
@@ -41,6 +47,22 @@ void page_table_init() {
             perror("Could not allocate pageTable");
             exit(-1);
         }
+#if FLAGS_METALLOC_PTRBITS > 32
+        /* Every granule of metadata takes a slot. Even if all memory were
+         * described per page, the arena must cover the reduced address
+         * space, which is no longer the case above 37 pointer bits. */
+        unsigned long minArenaSize = (((unsigned long)1 << FLAGS_METALLOC_PTRBITS) / METALLOC_PAGESIZE) * FLAGS_METALLOC_METADATABYTES;
+        if (minArenaSize > METADATAARENASIZE) {
+            fprintf(stderr, "Metadata arena of %lu MiB (2^%d slots) cannot describe a 2^%d byte address space: use fewer pointer bits\n",
+                    METADATAARENASIZE >> 20, 63 - FLAGS_METALLOC_PTRBITS, FLAGS_METALLOC_PTRBITS);
+            exit(-1);
+        }
+        void *arenaMap = sys_mmap((void*)METADATA_ARENA, METADATAARENASIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (arenaMap == MAP_FAILED) {
+            perror("Could not allocate metadata arena");
+            exit(-1);
+        }
+#endif
         isPageTableAlloced = true;
     }
 }
@@ -52,26 +74,160 @@ bool is_metapagetable_alloced() {
     return isPageTableAlloced;
 }
 
+/*
+ * Metadata arena, for fat pointers with more than 32 address bits. Their high
+ * bits only fit a slot offset from METADATA_ARENA (see staticlib/metadata.h),
+ * so all metadata is allocated from this fixed range, which page_table_init
+ * maps without reserving memory. Chunks are a power of two pages and are kept
+ * in a free list per size once released. The first page is never handed out,
+ * so that empty high bits never refer to valid metadata.
+ */
+#if FLAGS_METALLOC_PTRBITS > 32
+
+static char *arenaTop = (char*)METADATA_ARENA + SYSTEM_PAGESIZE;
+static void *arenaFreeLists[METADATAARENACLASSES];
+static char arenaLock = 0;
+
+static void arena_lock() {
+    while (__atomic_test_and_set(&arenaLock, __ATOMIC_ACQUIRE));
+}
+
+static void arena_unlock() {
+    __atomic_clear(&arenaLock, __ATOMIC_RELEASE);
+}
+
+static unsigned long arena_class(unsigned long size) {
+    unsigned long pages = (size + SYSTEM_PAGESIZE - 1) / SYSTEM_PAGESIZE;
+    return pages <= 1 ? 0 : 64 - __builtin_clzl(pages - 1);
+}
+
+void* allocate_metadata_arena(unsigned long size) {
+    unsigned long class = arena_class(size);
+    unsigned long chunkSize = (unsigned long)SYSTEM_PAGESIZE << class;
+    void *metadata = NULL;
+    if (unlikely(isPageTableAlloced == false))
+        page_table_init();
+    arena_lock();
+    if (arenaFreeLists[class]) {
+        metadata = arenaFreeLists[class];
+        arenaFreeLists[class] = *(void**)metadata;
+        *(void**)metadata = NULL;
+    } else if (arenaTop + chunkSize <= (char*)METADATA_ARENA + METADATAARENASIZE) {
+        metadata = arenaTop;
+        arenaTop += chunkSize;
+    }
+    arena_unlock();
+    return metadata;
+}
+
+void deallocate_metadata_arena(void *ptr, unsigned long size) {
+    unsigned long class = arena_class(size);
+    madvise(ptr, (unsigned long)SYSTEM_PAGESIZE << class, MADV_DONTNEED);
+    arena_lock();
+    *(void**)ptr = arenaFreeLists[class];
+    arenaFreeLists[class] = ptr;
+    arena_unlock();
+}
+
+/*
+ * Deep metadata objects, which fat pointers refer to directly, so they are
+ * in the arena as well. They are carved out of arena chunks and recycled
+ * through a free list, and are never returned to the arena.
+ */
+static void *deepFreeList;
+
+void* allocate_deep_metadata() {
+    void *deep;
+    arena_lock();
+    deep = deepFreeList;
+    if (deep)
+        deepFreeList = *(void**)deep;
+    arena_unlock();
+    if (deep) {
+        *(void**)deep = NULL;
+        return deep;
+    }
+
+    char *chunk = allocate_metadata_arena(DEEPMETADATACHUNKSIZE);
+    if (unlikely(chunk == NULL)) {
+        fprintf(stderr, "Could not allocate deep metadata: metadata arena of %lu MiB exhausted\n",
+                METADATAARENASIZE >> 20);
+        exit(-1);
+    }
+    unsigned long count = DEEPMETADATACHUNKSIZE / FLAGS_METALLOC_DEEPMETADATABYTES;
+    for (unsigned long i = 1; i + 1 < count; ++i)
+        *(void**)(chunk + i * FLAGS_METALLOC_DEEPMETADATABYTES) =
+            chunk + (i + 1) * FLAGS_METALLOC_DEEPMETADATABYTES;
+    arena_lock();
+    *(void**)(chunk + (count - 1) * FLAGS_METALLOC_DEEPMETADATABYTES) = deepFreeList;
+    deepFreeList = chunk + FLAGS_METALLOC_DEEPMETADATABYTES;
+    arena_unlock();
+    return chunk;
+}
+
+void deallocate_deep_metadata(void *ptr) {
+    arena_lock();
+    *(void**)ptr = deepFreeList;
+    deepFreeList = ptr;
+    arena_unlock();
+}
+
+#else
+
+void* allocate_metadata_arena(unsigned long size) {
+    return NULL;
+}
+
+void deallocate_metadata_arena(void *ptr, unsigned long size) {
+}
+
+void* allocate_deep_metadata() {
+    return NULL;
+}
+
+void deallocate_deep_metadata(void *ptr) {
+}
+
+#endif /* !FLAGS_METALLOC_PTRBITS > 32 */
+
 void* allocate_metadata(unsigned long size, unsigned long alignment) {
     /*if (unlikely(isPageTableAlloced == false))
         page_table_init();*/
     unsigned long pageAlignOffset = SYSTEM_PAGESIZE - 1;
     unsigned long pageAlignMask = ~((unsigned long)SYSTEM_PAGESIZE - 1);
     unsigned long metadataSize = (((size * FLAGS_METALLOC_METADATABYTES) >> alignment) + pageAlignOffset) & pageAlignMask;
+#if FLAGS_METALLOC_PTRBITS > 32
+    void *metadata = allocate_metadata_arena(metadataSize);
+    if (unlikely(metadata == NULL)) {
+        fprintf(stderr, "Could not allocate metadata: metadata arena of %lu MiB exhausted\n",
+                METADATAARENASIZE >> 20);
+        exit(-1);
+    }
+#else
     void *metadata = sys_mmap(NULL, metadataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     if (unlikely(metadata == MAP_FAILED)) {
         perror("Could not allocate metadata");
         exit(-1);
     }
+#endif
     return metadata;
 }
 
+/* Returns metadata from allocate_metadata to where it came from */
+static void free_metadata(void *metadata, unsigned long metadataSize) {
+#if FLAGS_METALLOC_PTRBITS > 32
+    deallocate_metadata_arena(metadata, metadataSize);
+#else
+    munmap(metadata, metadataSize);
+#endif
+}
+
 void deallocate_metadata(void *ptr, unsigned long size, unsigned long alignment) {
     unsigned long pageAlignOffset = SYSTEM_PAGESIZE - 1;
     unsigned long pageAlignMask = ~((unsigned long)SYSTEM_PAGESIZE - 1);
     unsigned long metadata = pageTable[((unsigned long)ptr) / METALLOC_PAGESIZE] >> 8;
     unsigned long metadataSize = (((size * FLAGS_METALLOC_METADATABYTES) >> alignment) + pageAlignOffset) & pageAlignMask;
-    munmap((void*)metadata, metadataSize);
+    free_metadata((void*)metadata, metadataSize);
     return;
 }
 
@@ -107,7 +263,135 @@ unsigned long get_metapagetable_entry(void *ptr) {
     // Get the page number
     unsigned long page = (unsigned long)ptr / METALLOC_PAGESIZE;
     // Get table entry
-    return pageTable[page];
+    unsigned long entry = pageTable[page];
+    if (unlikely(entry == 0))
+        entry = resolve_lazy_metapagetable_entry((unsigned long)ptr);
+    return entry;
+}
+
+/*
+ * Lazily initialized ranges, for stacks that are large but mostly unused.
+ * Registering a range allocates its metadata (which is reserved, not
+ * committed) but writes no pagetable entries. Lookups that find an empty
+ * entry resolve it here, writing the entries of the surrounding chunk of
+ * LAZYCHUNKPAGES pages, so entries are written in chunks as the stack grows.
+ * Regions are looked up without the lock, so that lookups of memory outside
+ * of any region stay cheap, but a region's entries are only written with the
+ * lock held after checking that it is still registered. Otherwise an
+ * unregister between the lookup and the write would leave entries pointing
+ * to freed metadata, which are never resolved again.
+ */
+#define LAZYREGIONS 1024
+#define LAZYCHUNKPAGES 64
+
+struct lazy_region {
+    unsigned long start; /* 0 for unused slots, published last */
+    unsigned long end;
+    char *metadata;
+    unsigned long alignment;
+    unsigned long low;   /* range of entries written so far */
+    unsigned long high;
+};
+
+static struct lazy_region lazyRegions[LAZYREGIONS];
+static unsigned long lazyRegionsUsed = 0;
+static char lazyRegionsLock = 0;
+
+static void lazy_regions_lock() {
+    while (__atomic_test_and_set(&lazyRegionsLock, __ATOMIC_ACQUIRE));
+}
+
+static void lazy_regions_unlock() {
+    __atomic_clear(&lazyRegionsLock, __ATOMIC_RELEASE);
+}
+
+static unsigned long metadata_mapping_size(unsigned long size, unsigned long alignment) {
+    unsigned long pageAlignOffset = SYSTEM_PAGESIZE - 1;
+    unsigned long pageAlignMask = ~((unsigned long)SYSTEM_PAGESIZE - 1);
+    return (((size * FLAGS_METALLOC_METADATABYTES) >> alignment) + pageAlignOffset) & pageAlignMask;
+}
+
+int register_lazy_metadata_region(void *ptr, unsigned long size, unsigned long alignment) {
+    if (unlikely(isPageTableAlloced == false))
+        page_table_init();
+    if (unlikely(size % METALLOC_PAGESIZE != 0)) {
+        printf("Meta-pagetable must be configured for ranges that are multiple of METALLOC_PAGESIZE");
+        exit(-1);
+    }
+
+    lazy_regions_lock();
+    unsigned long i;
+    for (i = 0; i < LAZYREGIONS && lazyRegions[i].start; ++i);
+    if (i == LAZYREGIONS) {
+        lazy_regions_unlock();
+        return 0;
+    }
+    struct lazy_region *region = &lazyRegions[i];
+    region->end = (unsigned long)ptr + size;
+    region->metadata = allocate_metadata(size, alignment);
+    region->alignment = alignment;
+    region->low = region->end;
+    region->high = (unsigned long)ptr;
+    __atomic_store_n(&region->start, (unsigned long)ptr, __ATOMIC_RELEASE);
+    if (i >= lazyRegionsUsed)
+        __atomic_store_n(&lazyRegionsUsed, i + 1, __ATOMIC_RELEASE);
+    lazy_regions_unlock();
+    return 1;
+}
+
+int unregister_lazy_metadata_region(void *ptr) {
+    lazy_regions_lock();
+    for (unsigned long i = 0; i < lazyRegionsUsed; ++i) {
+        struct lazy_region *region = &lazyRegions[i];
+        if (region->start != (unsigned long)ptr)
+            continue;
+
+        /* Clear the written entries, so that a region registered later at
+         * the same address is resolved again */
+        __atomic_store_n(&region->start, 0, __ATOMIC_RELEASE);
+        if (region->low < region->high)
+            set_metapagetable_entries((void*)region->low, region->high - region->low, 0, 0);
+        free_metadata(region->metadata, metadata_mapping_size(region->end - (unsigned long)ptr, region->alignment));
+        lazy_regions_unlock();
+        return 1;
+    }
+    lazy_regions_unlock();
+    return 0;
+}
+
+unsigned long resolve_lazy_metapagetable_entry(unsigned long ptrInt) {
+    unsigned long used = __atomic_load_n(&lazyRegionsUsed, __ATOMIC_ACQUIRE);
+    for (unsigned long i = 0; i < used; ++i) {
+        struct lazy_region *region = &lazyRegions[i];
+        unsigned long start = __atomic_load_n(&region->start, __ATOMIC_ACQUIRE);
+        if (!start || ptrInt < start || ptrInt >= region->end)
+            continue;
+
+        lazy_regions_lock();
+        if (region->start != start || ptrInt >= region->end) {
+            /* unregistered (and maybe replaced) in the meantime */
+            lazy_regions_unlock();
+            return get_metapagetable_entry((void*)ptrInt);
+        }
+
+        unsigned long chunkSize = LAZYCHUNKPAGES * METALLOC_PAGESIZE;
+        unsigned long chunkStart = start + (ptrInt - start) / chunkSize * chunkSize;
+        unsigned long chunkEnd = chunkStart + chunkSize;
+        if (chunkEnd > region->end)
+            chunkEnd = region->end;
+        char *metaptr = region->metadata +
+            ((chunkStart - start) >> region->alignment) * FLAGS_METALLOC_METADATABYTES;
+        set_metapagetable_entries((void*)chunkStart, chunkEnd - chunkStart, metaptr, region->alignment);
+
+        if (chunkStart < region->low)
+            region->low = chunkStart;
+        if (chunkEnd > region->high)
+            region->high = chunkEnd;
+        lazy_regions_unlock();
+
+        return pageTable[ptrInt / METALLOC_PAGESIZE];
+    }
+    return 0;
 }
 
 void allocate_metapagetable_entries(void *ptr, unsigned long size) {
@@ -13,14 +13,32 @@ extern "C" {
 
 //extern unsigned long pageTable[];
 #define pageTable ((unsigned long*)(0x400000000000))
+/* Fat pointers with more than 32 address bits store metadata pointers as slot
+ * offsets from here, so their metadata is allocated in this arena */
+#define METADATA_ARENA 0x500000000000ULL
 extern int is_fixed_compression();
 extern void page_table_init();
 extern void* allocate_metadata(unsigned long size, unsigned long alignment);
 extern void deallocate_metadata(void *ptr, unsigned long size, unsigned long alignment);
+extern void* allocate_metadata_arena(unsigned long size);
+extern void deallocate_metadata_arena(void *ptr, unsigned long size);
+extern void* allocate_deep_metadata();
+extern void deallocate_deep_metadata(void *ptr);
 extern void set_metapagetable_entries(void *ptr, unsigned long size, void *metaptr, int alignment);
 extern unsigned long get_metapagetable_entry(void *ptr);
 extern void allocate_metapagetable_entries(void *ptr, unsigned long size);
 extern void deallocate_metapagetable_entries(void *ptr, unsigned long size);
+extern int register_lazy_metadata_region(void *ptr, unsigned long size, unsigned long alignment);
+extern int unregister_lazy_metadata_region(void *ptr);
+extern unsigned long resolve_lazy_metapagetable_entry(unsigned long ptrInt);
+
+/* Pagetable entry of a page, resolving lazily initialized ranges */
+static inline unsigned long lookup_metapagetable_entry(unsigned long page) {
+    unsigned long entry = pageTable[page];
+    if (__builtin_expect(entry == 0, 0))
+        entry = resolve_lazy_metapagetable_entry(page * METALLOC_PAGESIZE);
+    return entry;
+}
 
 #ifdef __cplusplus
 }
@@ -16,7 +16,7 @@ int running_in_small_addr_space = 0;
 #ifdef strcmp
 #undef strcmp
 #endif
-#define PTR_MASK (0xffffffffULL | (1ULL<<63))
+#define PTR_MASK ((REDUCED_ADDRSPACE_SIZE - 1) | (1ULL<<63))
 int strcmp_unmasked(const char *l, const char *r)
 {
     for (; *l==*r && *l; l++, r++);
@@ -24,10 +24,9 @@ int strcmp_unmasked(const char *l, const char *r)
 }
 int strcmp(const char *l, const char *r)
 {
-    const char *ml = (const char *)(((uintptr_t)l) & PTR_MASK);
-    const char *mr = (const char *)(((uintptr_t)r) & PTR_MASK);
     if (running_in_small_addr_space)
-        return strcmp_unmasked(ml, mr);
+        return strcmp_unmasked((const char *)(((uintptr_t)l) & PTR_MASK),
+                               (const char *)(((uintptr_t)r) & PTR_MASK));
     else
         return strcmp_unmasked(l, r);
 }
@@ -49,6 +48,8 @@ int new_main(int argc, char **argv, char **envp)
     unmap_old_stack(oldstackptr);
     create_new_tls();
     setup_debug_sighandlers();
+    lowmap_init();
+    report_reservation();
 
     running_in_small_addr_space = 1;
 
@@ -118,7 +119,7 @@ void __shrinkaddrspace_preinit(int argc, char **argv, char **envp)
     if (whitelisted_program(argv[0]))
         return;
 
-    fill_high_holes();
+    reserve_high_addrspace();
 
 }
 __attribute__((section(".preinit_array")))
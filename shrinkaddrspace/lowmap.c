@@ -0,0 +1,375 @@
+/*
+ * Placement of mappings made after startup within the reduced address space.
+ *
+ * Once everything above the reduced address space is reserved, the kernel has
+ * to find room for every new mapping in the fragmented area below it, and its
+ * search gets slower (and its choices less predictable) as the process ages.
+ * Instead, the free ranges of [LOWMAP_START, REDUCED_ADDRSPACE_SIZE) are kept
+ * in two treaps, one ordered by address to merge neighbours and one by size
+ * for best-fit placement, and mappings are made at the chosen address with
+ * MAP_FIXED_NOREPLACE, which fails instead of clobbering anything mapped
+ * behind our back (older kernels treat it as a hint, which is also detected).
+ *
+ * The allocator is installed as the mmap/munmap replacement of tcmalloc's
+ * MallocHook, so tcmalloc's mmap wrapper (malloc_hook_mmap_linux.h) still sets
+ * the metapagetable entries of every mapping it returns. mremap and mappings
+ * made by direct system calls bypass it; ranges they occupy are dropped from
+ * the free set when a MAP_FIXED_NOREPLACE mapping collides with them.
+ *
+ * The lowest part of the address space is left to the kernel, for brk.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "../gperftools-metalloc/src/base/linux_syscall_support.h"
+
+#include "shrink.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define LOWMAP_START (1ULL << 30)
+#define LOWMAP_PAGESIZE 4096UL
+#define LOWMAP_MAXRANGES 16384
+#define LOWMAP_RETRIES 8
+
+/* Weak, so programs without tcmalloc run without the allocator */
+typedef int (*mmap_replacement_t)(const void *start, size_t size, int prot,
+        int flags, int fd, off_t offset, void **result);
+typedef int (*munmap_replacement_t)(const void *ptr, size_t size, int *result);
+int MallocHook_SetMmapReplacement(mmap_replacement_t hook) __attribute__((weak));
+int MallocHook_SetMunmapReplacement(munmap_replacement_t hook) __attribute__((weak));
+
+/* Trees: by address, and by size (then address) */
+enum { BY_ADDR, BY_SIZE, TREES };
+
+struct range {
+    uintptr_t start, size;
+    unsigned prio;
+    int child[TREES][2];
+};
+
+/* Node 0 is the nil node */
+static struct range ranges[LOWMAP_MAXRANGES + 1];
+static int roots[TREES];
+static int free_nodes[LOWMAP_MAXRANGES];
+static int num_free_nodes;
+static unsigned prio_state = 2463534242U;
+static char lowmap_lock_flag;
+static int lowmap_enabled;
+
+static void lowmap_lock(void)
+{
+    while (__atomic_test_and_set(&lowmap_lock_flag, __ATOMIC_ACQUIRE));
+}
+
+static void lowmap_unlock(void)
+{
+    __atomic_clear(&lowmap_lock_flag, __ATOMIC_RELEASE);
+}
+
+static int less(int tree, int a, int b)
+{
+    if (tree == BY_SIZE && ranges[a].size != ranges[b].size)
+        return ranges[a].size < ranges[b].size;
+    return ranges[a].start < ranges[b].start;
+}
+
+static int tree_insert(int tree, int root, int n)
+{
+    int dir, child;
+    if (!root)
+        return n;
+    dir = !less(tree, n, root);
+    child = tree_insert(tree, ranges[root].child[tree][dir], n);
+    ranges[root].child[tree][dir] = child;
+    if (ranges[child].prio > ranges[root].prio) {
+        /* rotate child up */
+        ranges[root].child[tree][dir] = ranges[child].child[tree][!dir];
+        ranges[child].child[tree][!dir] = root;
+        return child;
+    }
+    return root;
+}
+
+static int tree_merge(int tree, int a, int b)
+{
+    if (!a || !b)
+        return a ? a : b;
+    if (ranges[a].prio > ranges[b].prio) {
+        ranges[a].child[tree][1] = tree_merge(tree, ranges[a].child[tree][1], b);
+        return a;
+    }
+    ranges[b].child[tree][0] = tree_merge(tree, a, ranges[b].child[tree][0]);
+    return b;
+}
+
+static int tree_erase(int tree, int root, int n)
+{
+    if (root == n)
+        return tree_merge(tree, ranges[n].child[tree][0], ranges[n].child[tree][1]);
+    int dir = !less(tree, n, root);
+    ranges[root].child[tree][dir] =
+        tree_erase(tree, ranges[root].child[tree][dir], n);
+    return root;
+}
+
+static void range_insert(uintptr_t start, uintptr_t size)
+{
+    int n, t;
+    if (!num_free_nodes)
+        return; /* out of nodes: leave the range to the kernel */
+    n = free_nodes[--num_free_nodes];
+    prio_state ^= prio_state << 13;
+    prio_state ^= prio_state >> 17;
+    prio_state ^= prio_state << 5;
+    ranges[n].start = start;
+    ranges[n].size = size;
+    ranges[n].prio = prio_state;
+    for (t = 0; t < TREES; t++) {
+        ranges[n].child[t][0] = ranges[n].child[t][1] = 0;
+        roots[t] = tree_insert(t, roots[t], n);
+    }
+}
+
+static void range_erase(int n)
+{
+    int t;
+    for (t = 0; t < TREES; t++)
+        roots[t] = tree_erase(t, roots[t], n);
+    free_nodes[num_free_nodes++] = n;
+}
+
+/* Last free range starting at or below addr */
+static int range_floor(uintptr_t addr)
+{
+    int n = roots[BY_ADDR], best = 0;
+    while (n) {
+        if (ranges[n].start <= addr) {
+            best = n;
+            n = ranges[n].child[BY_ADDR][1];
+        } else {
+            n = ranges[n].child[BY_ADDR][0];
+        }
+    }
+    return best;
+}
+
+/* Smallest free range of at least size bytes */
+static int range_best_fit(uintptr_t size)
+{
+    int n = roots[BY_SIZE], best = 0;
+    while (n) {
+        if (ranges[n].size >= size) {
+            best = n;
+            n = ranges[n].child[BY_SIZE][0];
+        } else {
+            n = ranges[n].child[BY_SIZE][1];
+        }
+    }
+    return best;
+}
+
+/* Removes [start, start+size) from the free ranges */
+static void range_take(uintptr_t start, uintptr_t size)
+{
+    uintptr_t end = start + size;
+    int n;
+    while ((n = range_floor(end - 1)) &&
+           ranges[n].start + ranges[n].size > start) {
+        uintptr_t rstart = ranges[n].start;
+        uintptr_t rend = rstart + ranges[n].size;
+        range_erase(n);
+        if (rstart < start)
+            range_insert(rstart, start - rstart);
+        if (rend > end)
+            range_insert(end, rend - end);
+    }
+}
+
+/* Adds [start, start+size) to the free ranges, merging with neighbours */
+static void range_give(uintptr_t start, uintptr_t size)
+{
+    uintptr_t end = start + size;
+    int n;
+    if (start < LOWMAP_START)
+        start = LOWMAP_START;
+    if (end > REDUCED_ADDRSPACE_SIZE)
+        end = REDUCED_ADDRSPACE_SIZE;
+    if (start >= end)
+        return;
+    range_take(start, end - start);
+    n = range_floor(start);
+    if (n && ranges[n].start + ranges[n].size == start) {
+        start = ranges[n].start;
+        range_erase(n);
+    }
+    n = range_floor(end);
+    if (n && ranges[n].start == end) {
+        end += ranges[n].size;
+        range_erase(n);
+    }
+    range_insert(start, end - start);
+}
+
+/*
+ * Unmaps a mapping the kernel placed above the reduced address space, which
+ * tagged pointers cannot address, and fails it with ENOMEM instead.
+ */
+static int lowmap_reject_high(void *res, uintptr_t len)
+{
+    if ((uintptr_t)res + len <= REDUCED_ADDRSPACE_SIZE)
+        return 0;
+    sys_munmap(res, len);
+    errno = ENOMEM;
+    return 1;
+}
+
+static int lowmap_mmap(const void *start, size_t size, int prot, int flags,
+        int fd, off_t offset, void **result)
+{
+    uintptr_t len = (size + LOWMAP_PAGESIZE - 1) & ~(LOWMAP_PAGESIZE - 1);
+    int i;
+
+    if (!len)
+        return 0;
+
+    lowmap_lock();
+    if (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)) {
+        /* Mapped where the caller says, by tcmalloc's wrapper */
+        range_take((uintptr_t)start, len);
+        lowmap_unlock();
+        return 0;
+    }
+
+    for (i = 0; i < LOWMAP_RETRIES; i++) {
+        uintptr_t addr = 0;
+        int n = 0;
+        if (start && i == 0) {
+            n = range_floor((uintptr_t)start);
+            if (n && ranges[n].start + ranges[n].size < (uintptr_t)start + len)
+                n = 0;
+            addr = (uintptr_t)start;
+        }
+        if (!n) {
+            n = range_best_fit(len);
+            if (!n)
+                break;
+            /* Allocate from the top of the range, like the kernel */
+            addr = ranges[n].start + ranges[n].size - len;
+        }
+        range_take(addr, len);
+
+        void *res = sys_mmap((void*)addr, len, prot,
+                flags | MAP_FIXED_NOREPLACE, fd, offset);
+        if (res == (void*)addr) {
+            lowmap_unlock();
+            *result = res;
+            return 1;
+        }
+        /* Older kernels ignore MAP_FIXED_NOREPLACE and treat addr as a hint,
+         * so nothing was mapped there and the mapping may be anywhere. */
+        if (res != MAP_FAILED) {
+            range_give(addr, len);
+            if (lowmap_reject_high(res, len)) {
+                lowmap_unlock();
+                *result = MAP_FAILED;
+                return 1;
+            }
+            range_take((uintptr_t)res, len);
+            lowmap_unlock();
+            *result = res;
+            return 1;
+        }
+        /* Something is mapped there that we did not see, so the range stays
+         * out of the free set. */
+        if (errno != EEXIST)
+            break;
+    }
+    lowmap_unlock();
+
+    /* Let the kernel choose */
+    *result = sys_mmap((void*)start, size, prot, flags, fd, offset);
+    if (*result != MAP_FAILED && lowmap_reject_high(*result, len))
+        *result = MAP_FAILED;
+    if (*result != MAP_FAILED) {
+        lowmap_lock();
+        range_take((uintptr_t)*result, len);
+        lowmap_unlock();
+    }
+    return 1;
+}
+
+static int lowmap_munmap(const void *ptr, size_t size, int *result)
+{
+    uintptr_t len = (size + LOWMAP_PAGESIZE - 1) & ~(LOWMAP_PAGESIZE - 1);
+
+    *result = sys_munmap((void*)ptr, size);
+    if (*result == 0) {
+        lowmap_lock();
+        range_give((uintptr_t)ptr, len);
+        lowmap_unlock();
+    }
+    return 1;
+}
+
+/*
+ * Maps anonymous memory with the allocator, for thread stacks (threads.c).
+ * Returns MAP_FAILED if the allocator is not installed.
+ */
+void *lowmap_alloc(size_t size, int prot, int flags)
+{
+    void *result;
+    if (!lowmap_enabled)
+        return MAP_FAILED;
+    lowmap_mmap(NULL, size, prot, flags | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0,
+            &result);
+    return result;
+}
+
+/*
+ * Builds the free ranges from the current mappings and installs the allocator,
+ * unless SHRINK_LOWMAP=0 or the program does not use tcmalloc.
+ */
+void lowmap_init(void)
+{
+    struct mapinfo maps[256];
+    char *env = getenv("SHRINK_LOWMAP");
+    uintptr_t prev_end = LOWMAP_START;
+    int num_maps;
+    int i;
+
+    if ((env && !strcmp(env, "0")) || !MallocHook_SetMmapReplacement ||
+        !MallocHook_SetMunmapReplacement || lowmap_enabled)
+        return;
+
+    for (i = 0; i < LOWMAP_MAXRANGES; i++)
+        free_nodes[i] = LOWMAP_MAXRANGES - i;
+    num_free_nodes = LOWMAP_MAXRANGES;
+
+    num_maps = get_proc_maps(maps, 256);
+    for (i = 0; i < num_maps; i++) {
+        if (maps[i].end <= LOWMAP_START)
+            continue;
+        if (maps[i].start >= REDUCED_ADDRSPACE_SIZE)
+            break;
+        if (maps[i].start > prev_end)
+            range_give(prev_end, maps[i].start - prev_end);
+        if (maps[i].end > prev_end)
+            prev_end = maps[i].end;
+    }
+    if (prev_end < REDUCED_ADDRSPACE_SIZE)
+        range_give(prev_end, REDUCED_ADDRSPACE_SIZE - prev_end);
+
+    MallocHook_SetMmapReplacement(lowmap_mmap);
+    MallocHook_SetMunmapReplacement(lowmap_munmap);
+    lowmap_enabled = 1;
+}
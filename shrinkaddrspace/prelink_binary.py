@@ -6,9 +6,18 @@ import shlex
 import shutil
 import subprocess
 import re
+import hashlib
+import tempfile
 
 from elftools.elf.elffile import ELFFile
 from elftools.elf.segments import InterpSegment
+from elftools.elf.sections import NoteSection
+
+
+# Libraries shared by most binaries are placed first, in this order, so they
+# get the same base address (and cache entry) in every binary.
+COMMON_LIBS = ["ld-linux", "libc.so", "libm.so", "libpthread.so", "libdl.so",
+        "librt.so", "libgcc_s.so", "libstdc++.so", "libtcmalloc"]
 
 
 def ex(cmd):
@@ -82,13 +91,82 @@ def get_library_deps(library):
     return deps
 
 
-def prelink_libs(libs, outdir, existing_mappings, baseaddr=0xf0ffffff):
+def get_build_id(lib):
+    """Returns the GNU build-id of a library, or a hash of its contents if it
+    has none."""
+
+    with open(lib, 'rb') as f:
+        e = ELFFile(f)
+        for sec in e.iter_sections():
+            if not isinstance(sec, NoteSection):
+                continue
+            for note in sec.iter_notes():
+                if note['n_type'] == 'NT_GNU_BUILD_ID':
+                    return note['n_desc']
+
+    h = hashlib.sha1()
+    with open(lib, 'rb') as f:
+        for block in iter(lambda: f.read(1 << 20), b''):
+            h.update(block)
+    return h.hexdigest()
+
+
+def lib_order(lib):
+    """Sort key placing the common libraries first, then the others by
+    name, so placement does not depend on the order ldd reports them."""
+
+    name = os.path.basename(lib)
+    for i, prefix in enumerate(COMMON_LIBS):
+        if name.startswith(prefix):
+            return (i, name)
+    return (len(COMMON_LIBS), name)
+
+
+def prelink_cached(lib, newlib, baseaddr, cachedir, modify):
+    """Create a copy of `lib` prelinked to `baseaddr` at `newlib`, reusing a
+    copy from `cachedir` keyed by build-id and base address when present.
+    Cached copies are hardlinked unless the copy is modified afterwards."""
+
+    if not cachedir:
+        shutil.copy(lib, newlib)
+        ex("prelink -r 0x%x \"%s\"" % (baseaddr, newlib))
+        return
+
+    entry = os.path.join(cachedir, "%s-%08x" % (get_build_id(lib), baseaddr),
+            os.path.basename(lib))
+    if not os.path.isfile(entry):
+        # Prelink into a temporary copy and move it in place, so concurrent
+        # runs never see a partially prelinked library
+        if not os.path.isdir(os.path.dirname(entry)):
+            try:
+                os.makedirs(os.path.dirname(entry))
+            except OSError:
+                if not os.path.isdir(os.path.dirname(entry)):
+                    raise
+        fd, tmp = tempfile.mkstemp(dir=os.path.dirname(entry))
+        os.close(fd)
+        shutil.copy(lib, tmp)
+        ex("prelink -r 0x%x \"%s\"" % (baseaddr, tmp))
+        os.rename(tmp, entry)
+        print "Cached %s" % entry
+
+    if not modify:
+        try:
+            os.link(entry, newlib)
+            return
+        except OSError:
+            pass
+    shutil.copy(entry, newlib)
+
+
+def prelink_libs(libs, outdir, existing_mappings, baseaddr=0xf0ffffff,
+        cachedir=None, modified=()):
     """For every library we calculate its size and alignment, find a space in
     our new compact addr space and create a copy of the library that is
     prelinked to the addr. Start mapping these from the *end* of the addr space
     down, but leaving a bit of space at the top for stuff like the stack."""
 
-    for lib in libs:
+    for lib in sorted(libs, key=lib_order):
         with open(lib, 'rb') as f:
             # Determine the alignment and size required for all LOAD segments
             # combined
@@ -118,8 +196,7 @@ def prelink_libs(libs, outdir, existing_mappings, baseaddr=0xf0ffffff):
             print "Found %08x - %08x for %s" % (baseaddr, baseaddr + size, lib)
 
             newlib = os.path.join(outdir, os.path.basename(lib))
-            shutil.copy(lib, newlib)
-            ex("prelink -r 0x%x \"%s\"" % (baseaddr, newlib))
+            prelink_cached(lib, newlib, baseaddr, cachedir, lib in modified)
 
 
 
@@ -138,6 +215,10 @@ def main():
             help="Library used via LD_PRELOAD that moves stack and mmap_base")
     parser.add_argument("--out-dir", default="",
             help="Output directory for prelinked libs")
+    parser.add_argument("--cache-dir",
+            default=os.environ.get("PRELINK_CACHE", ""),
+            help="Directory of prelinked libs shared between binaries, "
+            "keyed by build-id and base address (default: $PRELINK_CACHE)")
     args = parser.parse_args()
 
     outdir = args.out_dir
@@ -160,7 +241,9 @@ def main():
     libs.add(args.preload_lib)
 
     # The magic, construct new addr space by prelinking all dependency libs
-    prelink_libs(libs, outdir, binary_mappings)
+    modified = (args.preload_lib,) if args.set_rpath else ()
+    prelink_libs(libs, outdir, binary_mappings, cachedir=args.cache_dir,
+            modified=modified)
 
     # Update the loader to use our prelinked version
     if args.in_place:
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -23,9 +24,35 @@
 /* Not defined in glibc */
 int arch_prctl(int code, unsigned long *addr);
 
-#define REDUCED_ADDRSPACE_SIZE (1ULL << 32)
 #define KERN_ADDRSPACE (1ULL << 47)
 
+enum reserve_mode { RESERVE_SINGLE, RESERVE_HOLES };
+static enum reserve_mode reserve_mode = RESERVE_SINGLE;
+static int high_reserved;
+static struct timespec reserve_start;
+
+/*
+ * Size of the reduced address space. Fat pointers with more address bits
+ * (staticlib built with PTR_BITS=36, say) can use a larger heap, so
+ * SHRINK_PTR_BITS selects their split without rebuilding this library. The
+ * meta-pagetable at 1 << 46 (pageTable in metapagetable_core.h) must remain
+ * above it.
+ */
+uintptr_t reduced_addrspace_size(void)
+{
+    static uintptr_t size;
+    if (!size) {
+        char *env = getenv("SHRINK_PTR_BITS");
+        unsigned long bits = env ? strtoul(env, NULL, 10) : PTR_BITS;
+        if (bits < 32 || bits > 46) {
+            fprintf(stderr, "ERROR: SHRINK_PTR_BITS must be between 32 and 46\n");
+            exit(1);
+        }
+        size = 1ULL << bits;
+    }
+    return size;
+}
+
 /*
  * Often we are put in the environment too early, and thus we're preloaded for
  * wrapper scripts and such. These programs (e.g., dash) are not prelinked and
@@ -267,6 +294,100 @@ void fill_high_holes(void)
         }
 }
 
+static void reserve_range(uintptr_t start, uintptr_t end, int prot)
+{
+    void *tmp;
+    if (start >= end)
+        return;
+    tmp = sys_mmap((void*)start, end - start, prot,
+            MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    assert(tmp == (void*)start);
+}
+
+/*
+ * Reserves a hole. This includes the range of the meta-pagetable, which
+ * page_table_init maps over with MAP_FIXED only in programs that use it, so
+ * that other programs (whitelisted or not instrumented) neither commit to nor
+ * can write into its 512 GiB.
+ */
+static void reserve_hole(uintptr_t start, uintptr_t end)
+{
+    reserve_range(start, end, PROT_NONE);
+}
+
+/*
+ * Reserves everything above the reduced address space with as few mappings as
+ * possible: one per hole between the mappings that cannot be moved (the old
+ * stack, vvar and vdso), and the hole above the last mapping. Reservations use identical flags, so when the old stack is replaced
+ * by a reservation later (see unmap_old_stack) the kernel merges it with the
+ * holes around it into a single VMA.
+ */
+static void reserve_high_single(void)
+{
+    struct mapinfo maps[256];
+    size_t num_maps;
+    size_t i;
+    uintptr_t prev_end = REDUCED_ADDRSPACE_SIZE;
+    num_maps = get_proc_maps(maps, 256);
+    for (i = 0; i < num_maps; i++) {
+        if (maps[i].end <= REDUCED_ADDRSPACE_SIZE ||
+            maps[i].start >= KERN_ADDRSPACE)
+            continue;
+        if (maps[i].start > prev_end)
+            reserve_hole(prev_end, maps[i].start);
+        prev_end = maps[i].end;
+    }
+    /* The last user page cannot be mapped */
+    reserve_hole(prev_end, KERN_ADDRSPACE - 4096);
+}
+
+/*
+ * Reserves all memory above the reduced address space, so the kernel places
+ * new mappings below it. SHRINK_RESERVE_MODE=holes selects the original
+ * approach of fill_high_holes, anything else the single reservation above.
+ * Both leave the page right above the reduced address space PROT_NONE, which
+ * the mask reuse of the LLVM passes relies on as a guard (see MaskCache.h).
+ * DO NOT CALL GLIBC FUNCTIONS THAT MAY ALLOC BEFORE/DURING THIS.
+ */
+void reserve_high_addrspace(void)
+{
+    char *mode = getenv("SHRINK_RESERVE_MODE");
+
+    clock_gettime(CLOCK_MONOTONIC, &reserve_start);
+    if (mode && !strcmp(mode, "holes"))
+        reserve_mode = RESERVE_HOLES;
+
+    if (reserve_mode == RESERVE_HOLES)
+        fill_high_holes();
+    else
+        reserve_high_single();
+    high_reserved = 1;
+}
+
+/* Whether the kernel places new mappings within the reduced address space */
+int high_addrspace_reserved(void)
+{
+    return high_reserved;
+}
+
+/*
+ * Reports the number of mappings and the time from reserving the address
+ * space until the program's main, to compare the reservation modes.
+ */
+void report_reservation(void)
+{
+    struct mapinfo maps[256];
+    struct timespec now;
+    int num_maps;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    num_maps = get_proc_maps(maps, 256);
+    debug_print("reserve mode %s: %d mappings, %ld us until main\n",
+            reserve_mode == RESERVE_HOLES ? "holes" : "single", num_maps,
+            (now.tv_sec - reserve_start.tv_sec) * 1000000L +
+            (now.tv_nsec - reserve_start.tv_nsec) / 1000L);
+}
+
 void sig_handler(int sig, siginfo_t *si, void *ptr)
 {
     fprintf(stderr, " *** Signal %d (%s)\n", sig, strsignal(sig));
@@ -310,8 +431,12 @@ void unmap_old_stack(uintptr_t oldstackptr)
         {
             debug_print("Found old stack mapping: %016lx-%016lx\n",
                     maps[i].start, maps[i].end);
-            mprotect((void*)maps[i].start, maps[i].end - maps[i].start,
-                    PROT_NONE);
+            if (reserve_mode == RESERVE_SINGLE &&
+                maps[i].start >= REDUCED_ADDRSPACE_SIZE)
+                reserve_hole(maps[i].start, maps[i].end);
+            else
+                mprotect((void*)maps[i].start, maps[i].end - maps[i].start,
+                        PROT_NONE);
         }
 }
 
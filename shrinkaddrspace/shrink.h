@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #define DEBUG
@@ -7,6 +8,13 @@
 #define debug_print(...) do { } while(0)
 #endif
 
+/* Address bits of fat pointers (see staticlib/metadata.h), overridden at run
+ * time with SHRINK_PTR_BITS. The reduced address space is 1 << PTR_BITS. */
+#ifndef PTR_BITS
+#define PTR_BITS 32
+#endif
+#define REDUCED_ADDRSPACE_SIZE reduced_addrspace_size()
+
 typedef int (*main_t)(int, char **, char **);
 typedef int (*libc_start_main_t)(main_t main, int argc, char **ubp_av,
         void (*init)(void), void (*fini)(void), void (*rtld_fini)(void),
@@ -17,10 +25,16 @@ struct mapinfo
     uintptr_t start, end;
 };
 
+uintptr_t reduced_addrspace_size(void);
 int whitelisted_program(char *program);
 void create_new_stack(char **ubp_av, void *stack_end,
         uintptr_t *new_stack_ptr, uintptr_t *new_stack_end, uintptr_t *new_ubp);
 void fill_high_holes(void);
+void reserve_high_addrspace(void);
+int high_addrspace_reserved(void);
+void report_reservation(void);
+void lowmap_init(void);
+void *lowmap_alloc(size_t size, int prot, int flags);
 void unmap_old_stack(uintptr_t oldstackptr);
 void create_new_tls(void);
 void setup_debug_sighandlers(void);
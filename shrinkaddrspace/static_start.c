@@ -0,0 +1,148 @@
+/*
+ * Startup code for fully static builds, as an alternative to prelinking and
+ * libshrink-preload.so.
+ *
+ * A static non-PIE binary already has its text, data, heap (brk) and the TLS
+ * of the main thread (allocated with sbrk by glibc) at low addresses, and the
+ * stack is reserved below as a page-aligned array in .bss. It is not placed
+ * with a linker script, since gold, which LTO builds link with, does not
+ * support INSERT. Only the initial process block (argc, argv, envp, auxv and their strings),
+ * which the kernel puts at the top of the address space, has to be moved onto
+ * that stack before glibc's _start runs. This is a few KB, instead of the copy
+ * of the whole stack the preload library makes.
+ *
+ * A preinit function then reserves everything above the reduced address space,
+ * including the kernel's old stack, as libshrink-static.a does, so the kernel
+ * places new mappings below it. tcmalloc's mappings are placed low by lowmap.c
+ * and thread stacks come from threads.c (linked with -Wl,--wrap).
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <elf.h>
+#include <sys/mman.h>
+
+#include "shrink.h"
+
+/* Size of the main stack, set at build time with SHRINK_STACK_SIZE=<bytes> */
+#ifndef SHRINK_STACK_SIZE
+#define SHRINK_STACK_SIZE 0x800000
+#endif
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+/* Pages of .bss are only backed when touched, like those of a stack */
+char __shrink_stack_start[SHRINK_STACK_SIZE] __attribute__((aligned(4096)));
+
+/* The end as a symbol of its own, for staticlib/globalinit.c */
+__asm__(
+    ".globl __shrink_stack_end\n"
+    ".set __shrink_stack_end, __shrink_stack_start + " XSTR(SHRINK_STACK_SIZE) "\n");
+extern char __shrink_stack_end[];
+
+/*
+ * Entry point (-Wl,-e,_shrink_start): move the process block with a
+ * C function that runs on the kernel's stack, then enter glibc on the new one
+ * with %rdx (the rtld_fini function of the ELF ABI) cleared, as the kernel
+ * does for static binaries.
+ */
+__asm__(
+    ".text\n"
+    ".globl _shrink_start\n"
+    ".type _shrink_start, @function\n"
+    "_shrink_start:\n"
+    "    mov %rsp, %rdi\n"
+    "    and $-16, %rsp\n"
+    "    call shrink_static_entry\n"
+    "    mov %rax, %rsp\n"
+    "    xor %edx, %edx\n"
+    "    jmp _start\n"
+    ".size _shrink_start, .-_shrink_start\n");
+
+uintptr_t shrink_static_entry(uintptr_t *sp) __attribute__((used));
+
+/* The kernel's stack pointer, whose mapping is reserved in preinit */
+static uintptr_t old_stack_ptr;
+
+static uintptr_t string_end(const char *s)
+{
+    while (*s)
+        s++;
+    return (uintptr_t)s + 1;
+}
+
+/*
+ * Copies the process block at sp to the top of the linked stack and returns
+ * the new stack pointer. No libc functions can be called yet (memcpy is an
+ * IFUNC that is not resolved before _start).
+ */
+uintptr_t shrink_static_entry(uintptr_t *sp)
+{
+    uintptr_t argc = sp[0];
+    char **argv = (char **)(sp + 1);
+    char **envp = argv + argc + 1;
+    char **p;
+    Elf64_auxv_t *auxv, *a;
+    uintptr_t start = (uintptr_t)sp, end = start, len, new_sp, delta;
+
+    old_stack_ptr = start;
+
+    /* The strings follow the vectors, up to the top of the stack */
+    for (p = argv; *p; p++)
+        if (string_end(*p) > end)
+            end = string_end(*p);
+    for (p = envp; *p; p++)
+        if (string_end(*p) > end)
+            end = string_end(*p);
+    auxv = (Elf64_auxv_t *)(p + 1);
+    for (a = auxv; a->a_type != AT_NULL; a++) {
+        uintptr_t v = a->a_un.a_val;
+        if (a->a_type == AT_EXECFN || a->a_type == AT_PLATFORM ||
+            a->a_type == AT_BASE_PLATFORM) {
+            if (string_end((const char *)v) > end)
+                end = string_end((const char *)v);
+        } else if (a->a_type == AT_RANDOM) {
+            if (v + 16 > end)
+                end = v + 16;
+        }
+    }
+    if ((uintptr_t)(a + 1) > end)
+        end = (uintptr_t)(a + 1);
+
+    len = end - start;
+    new_sp = ((uintptr_t)__shrink_stack_end - len) & ~15UL;
+    delta = start - new_sp;
+    __asm__ volatile("rep movsb"
+            : "+D"(new_sp), "+S"(start), "+c"(len) : : "memory");
+    new_sp = (uintptr_t)sp - delta;
+    start = (uintptr_t)sp;
+
+    /* Pointers into the block point into the copy */
+    argv = (char **)((uintptr_t)argv - delta);
+    envp = (char **)((uintptr_t)envp - delta);
+    for (p = argv; *p; p++)
+        *p -= delta;
+    for (p = envp; *p; p++)
+        *p -= delta;
+    for (a = (Elf64_auxv_t *)(p + 1); a->a_type != AT_NULL; a++)
+        if (a->a_un.a_val >= start && a->a_un.a_val < end)
+            a->a_un.a_val -= delta;
+
+    return new_sp;
+}
+
+void __shrinkaddrspace_static_preinit(int argc, char **argv, char **envp)
+{
+    (void)argc, (void)argv, (void)envp;
+
+    /* Guard page below the linked stack */
+    mprotect(__shrink_stack_start, 4096, PROT_NONE);
+    reserve_high_addrspace();
+    unmap_old_stack(old_stack_ptr);
+    lowmap_init();
+    report_reservation();
+}
+__attribute__((section(".preinit_array")))
+    typeof(__shrinkaddrspace_static_preinit) *__shrinkaddrspace_static_preinit_array
+        = __shrinkaddrspace_static_preinit;
@@ -0,0 +1,252 @@
+/*
+ * Thread stacks inside the reduced address space.
+ *
+ * glibc places the thread control block and the static TLS blocks of a thread
+ * at the top of its stack, so by handing every new thread a stack from a pool
+ * of low mappings, both the stack and the static TLS of all threads stay
+ * within the reduced address space. Dynamic TLS (dlopen'ed modules) is
+ * malloc'ed, and the heap is already low.
+ *
+ * Stacks are recycled: a joinable thread's stack after pthread_join returns, a
+ * detached thread's stack once the kernel no longer knows its tid (tgkill
+ * fails with ESRCH), as glibc keeps using the top of the stack until then.
+ *
+ * The preload library interposes pthread_create/join/detach directly; the
+ * static library provides __wrap_ versions for linking with
+ * -Wl,--wrap=pthread_create,--wrap=pthread_join,--wrap=pthread_detach.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "../gperftools-metalloc/src/base/linux_syscall_support.h"
+
+#include "shrink.h"
+
+#define MAX_THREAD_STACKS 4096
+#define DEFAULT_STACK_SIZE (8UL << 20)
+#define GUARD_SIZE 4096UL
+
+typedef int (*pthread_create_t)(pthread_t *thread, const pthread_attr_t *attr,
+        void *(*start_routine)(void *), void *arg);
+typedef int (*pthread_join_t)(pthread_t thread, void **retval);
+typedef int (*pthread_detach_t)(pthread_t thread);
+
+#ifdef SHRINK_STATIC
+int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+        void *(*start_routine)(void *), void *arg);
+int __real_pthread_join(pthread_t thread, void **retval);
+int __real_pthread_detach(pthread_t thread);
+#define WRAPPED(name) __wrap_##name
+#define REAL(name) __real_##name
+#else
+#define WRAPPED(name) name
+#define REAL(name) ((name##_t)dlsym(RTLD_NEXT, #name))
+#endif
+
+enum stack_state { STACK_FREE, STACK_JOINABLE, STACK_DETACHED };
+
+struct thread_stack {
+    void *map;              /* NULL for unused slots */
+    size_t size;            /* of the mapping, including the guard page */
+    enum stack_state state;
+    pthread_t thread;
+    pid_t tid;              /* set by the thread itself, 0 before it runs */
+    void *(*start_routine)(void *);
+    void *arg;
+};
+
+static struct thread_stack stacks[MAX_THREAD_STACKS];
+static pthread_mutex_t stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Detached threads may still run on their stack after pthread_exit */
+static int thread_gone(struct thread_stack *s)
+{
+    return s->tid && syscall(SYS_tgkill, getpid(), s->tid, 0) == -1 &&
+        errno == ESRCH;
+}
+
+static size_t default_stack_size(void)
+{
+    struct rlimit stacklimit;
+    getrlimit(RLIMIT_STACK, &stacklimit);
+    if (stacklimit.rlim_cur == RLIM_INFINITY || stacklimit.rlim_cur < 4096)
+        return DEFAULT_STACK_SIZE;
+    return stacklimit.rlim_cur;
+}
+
+/*
+ * Returns a free low stack of the given size (excluding the guard page),
+ * reusing the stack of an exited thread if possible, or NULL.
+ */
+static struct thread_stack *get_stack(size_t size)
+{
+    struct thread_stack *unused = NULL;
+    size_t mapsize = ((size + 4095) & ~4095UL) + GUARD_SIZE;
+    int i;
+
+    pthread_mutex_lock(&stacks_lock);
+    for (i = 0; i < MAX_THREAD_STACKS; i++) {
+        struct thread_stack *s = &stacks[i];
+        if (!s->map) {
+            if (!unused)
+                unused = s;
+            continue;
+        }
+        if (s->state == STACK_DETACHED && thread_gone(s))
+            s->state = STACK_FREE;
+        if (s->state == STACK_FREE && s->size == mapsize)
+            goto found;
+    }
+    if (!unused) {
+        pthread_mutex_unlock(&stacks_lock);
+        return NULL;
+    }
+
+    /* Anywhere in the reduced address space. MAP_32BIT limits stacks to the
+     * lowest 2 GiB, where they compete with the heap, so it is only used when
+     * nothing else keeps them low (whitelisted programs, and static builds
+     * without tcmalloc). */
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK;
+    void *map = lowmap_alloc(mapsize, PROT_READ | PROT_WRITE, flags);
+    if (map == MAP_FAILED) {
+        if (!high_addrspace_reserved())
+            flags |= MAP_32BIT;
+        map = sys_mmap(NULL, mapsize, PROT_READ | PROT_WRITE, flags, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        pthread_mutex_unlock(&stacks_lock);
+        return NULL;
+    }
+    mprotect(map, GUARD_SIZE, PROT_NONE);
+    unused->map = map;
+    unused->size = mapsize;
+    i = unused - stacks;
+
+found:
+    stacks[i].state = STACK_JOINABLE;
+    stacks[i].tid = 0;
+    pthread_mutex_unlock(&stacks_lock);
+    return &stacks[i];
+}
+
+static struct thread_stack *find_stack(pthread_t thread)
+{
+    int i;
+    for (i = 0; i < MAX_THREAD_STACKS; i++)
+        if (stacks[i].map && stacks[i].state != STACK_FREE &&
+            pthread_equal(stacks[i].thread, thread))
+            return &stacks[i];
+    return NULL;
+}
+
+static void *thread_start(void *arg)
+{
+    struct thread_stack *s = arg;
+    /* Before pthread_create returns the thread may already detach itself */
+    pthread_mutex_lock(&stacks_lock);
+    s->thread = pthread_self();
+    s->tid = syscall(SYS_gettid);
+    pthread_mutex_unlock(&stacks_lock);
+    return s->start_routine(s->arg);
+}
+
+int WRAPPED(pthread_create)(pthread_t *thread, const pthread_attr_t *attr,
+        void *(*start_routine)(void *), void *arg)
+{
+    pthread_attr_t newattr;
+    struct thread_stack *s;
+    void *stackaddr = NULL;
+    size_t stacksize = 0;
+    int detachstate = PTHREAD_CREATE_JOINABLE;
+    int ret;
+
+    if (attr) {
+        pthread_attr_getstack(attr, &stackaddr, &stacksize);
+        pthread_attr_getdetachstate(attr, &detachstate);
+    }
+
+    /* Threads with their own stack are left alone. glibc returns the end of
+     * the stack minus its size, which is only 0 when no stack was set. */
+    if ((uintptr_t)stackaddr + stacksize)
+        return REAL(pthread_create)(thread, attr, start_routine, arg);
+
+    if (attr)
+        pthread_attr_getstacksize(attr, &stacksize);
+
+    if (!attr || !stacksize)
+        stacksize = default_stack_size();
+    s = get_stack(stacksize);
+    if (!s) {
+        fprintf(stderr, "ERROR: no low stack for new thread\n");
+        return EAGAIN;
+    }
+
+    /* A shallow copy, as the stack must not be set on the caller's attributes.
+     * It is not destroyed, as it shares any allocated state with attr. */
+    if (attr)
+        memcpy(&newattr, attr, sizeof(newattr));
+    else
+        pthread_attr_init(&newattr);
+    pthread_attr_setstack(&newattr, (char*)s->map + GUARD_SIZE,
+            s->size - GUARD_SIZE);
+    pthread_attr_setguardsize(&newattr, 0);
+
+    s->start_routine = start_routine;
+    s->arg = arg;
+    ret = REAL(pthread_create)(thread, &newattr, thread_start, s);
+    if (!attr)
+        pthread_attr_destroy(&newattr);
+
+    pthread_mutex_lock(&stacks_lock);
+    if (ret) {
+        s->state = STACK_FREE;
+    } else {
+        s->thread = *thread;
+        if (detachstate == PTHREAD_CREATE_DETACHED)
+            s->state = STACK_DETACHED;
+    }
+    pthread_mutex_unlock(&stacks_lock);
+    return ret;
+}
+
+int WRAPPED(pthread_join)(pthread_t thread, void **retval)
+{
+    struct thread_stack *s;
+    int ret = REAL(pthread_join)(thread, retval);
+    if (ret)
+        return ret;
+
+    pthread_mutex_lock(&stacks_lock);
+    s = find_stack(thread);
+    if (s)
+        s->state = STACK_FREE;
+    pthread_mutex_unlock(&stacks_lock);
+    return ret;
+}
+
+int WRAPPED(pthread_detach)(pthread_t thread)
+{
+    struct thread_stack *s;
+    int ret = REAL(pthread_detach)(thread);
+    if (ret)
+        return ret;
+
+    pthread_mutex_lock(&stacks_lock);
+    s = find_stack(thread);
+    if (s)
+        s->state = STACK_DETACHED;
+    pthread_mutex_unlock(&stacks_lock);
+    return ret;
+}
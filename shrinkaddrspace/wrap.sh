@@ -11,9 +11,25 @@ if [ ! -f $prog ]; then
 fi
 
 prelink_dir="prelink-`echo $prog | tr / _`"
-"$DIR/prelink_binary.py" --set-rpath "$prog" --preload-lib "$DIR/libpreload.so"
-
 newprog="$prelink_dir/`basename "$prog"`"
+
+# Only prelink again when the binary, libpreload.so or one of the libraries
+# it links against changed (by build-id), and share prelinked libraries
+# between binaries through the cache
+build_ids() {
+    for f in "$prog" "$DIR/libpreload.so" \
+             `ldd "$prog" | awk '$2 == "=>" && $3 ~ /^\// { print $3 } $1 ~ /^\// { print $1 }'`; do
+        id=`readelf -n "$f" 2>/dev/null | awk '/Build ID/ { print $3 }'`
+        echo "$f ${id:-`md5sum < "$f" | cut -d' ' -f1`}"
+    done
+}
+ids="`build_ids`"
+export PRELINK_CACHE="${PRELINK_CACHE:-$HOME/.cache/shrinkaddrspace-prelink}"
+if [ ! -f "$newprog" ] || [ "$ids" != "`cat "$prelink_dir/build-ids" 2>/dev/null`" ]; then
+    "$DIR/prelink_binary.py" --set-rpath "$prog" --preload-lib "$DIR/libpreload.so" &&
+        echo "$ids" > "$prelink_dir/build-ids"
+fi
+
 export LD_LIBRARY_PATH="`pwd`/$prelink_dir:$LD_LIRARY_PATH"
 export LD_PRELOAD="`pwd`/$prelink_dir/libpreload.so"
 exec "$newprog" "$@"
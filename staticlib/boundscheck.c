@@ -0,0 +1,99 @@
+#include <stddef.h>
+#include <metadata.h>
+#include <metapagetable_core.h>
+
+#define unlikely(x)     __builtin_expect((x),0)
+
+/*
+ * Bounds checks on the metadata set by bounds_alloc_hook
+ * (metapagetable/boundshooks.c): [base, end) in 16-byte metadata, or the base
+ * in the low and the end in the high half of 8-byte metadata. An end of zero
+ * means that the bounds of the object are unknown (stack, globals and memory
+ * not allocated by tcmalloc), which is not checked.
+ *
+ * boundscheck_N checks an access of size bytes at ptrInt, boundscheck_range_N
+ * all accesses in [start, end) to the object of start at once, for accesses in
+ * loops whose address range is known before the loop runs.
+ */
+
+#define BOUNDS_8(metadata, base, end)                   \
+    unsigned long base = (metadata) & 0xffffffffUL;     \
+    unsigned long end = (metadata) >> 32;
+
+#define BOUNDS_16(metadata, base, end)                  \
+    unsigned long base = (metadata).a;                  \
+    unsigned long end = (metadata).b;
+
+#define CHECK_BOUNDS(size, metadata, first, last)       \
+    BOUNDS_##size(metadata, objBase, objEnd)            \
+    if (unlikely(objEnd != 0 &&                         \
+                 ((first) < objBase || (last) > objEnd)))\
+        __builtin_trap();
+
+#ifdef MIDFAT_POINTERS
+
+/* the bounds are behind the fat pointer, without a pagetable lookup */
+#define CREATE_BOUNDSCHECK(size)                                    \
+void boundscheck_##size (unsigned long ptrInt,                      \
+                        unsigned long accessSize) {                 \
+    if (unlikely((ptrInt >> PTR_BITS) == 0))                        \
+        return;                                                     \
+    meta##size metadata = *(meta##size *)METAPTR_DECODE(ptrInt, size);\
+    unsigned long addr = ptrInt & PTR_MASK;                         \
+    CHECK_BOUNDS(size, metadata, addr, addr + accessSize)           \
+}                                                                   \
+void boundscheck_range_##size (unsigned long start,                 \
+                        unsigned long end) {                        \
+    if (unlikely((start >> PTR_BITS) == 0 || start >= end))         \
+        return;                                                     \
+    meta##size metadata = *(meta##size *)METAPTR_DECODE(start, size);\
+    CHECK_BOUNDS(size, metadata, start & PTR_MASK, end & PTR_MASK)  \
+}
+
+#else
+
+/*
+ * The page table finds the bounds of the object at the accessed address, not
+ * of the object the pointer was derived from, so these only catch accesses
+ * outside of the contents of any allocation. They are here to compare the cost
+ * of the lookup with the fat pointer version. Memory without pagetable entries
+ * (mmap'ed files, libc's tables, ...) has unknown bounds.
+ */
+#define CREATE_BOUNDSCHECK(size)                                    \
+static inline meta##size *boundsptr_##size (unsigned long ptrInt) { \
+    unsigned long page = ptrInt / METALLOC_PAGESIZE;                \
+    unsigned long entry = lookup_metapagetable_entry(page);         \
+    if (unlikely(entry == 0))                                       \
+        return NULL;                                                \
+    unsigned long alignment = entry & 0xFF;                         \
+    char *metabase = (char*)(entry >> 8);                           \
+    unsigned long pageOffset = ptrInt - (page * METALLOC_PAGESIZE); \
+    return (meta##size *)(metabase + ((pageOffset >> alignment) *   \
+                                        size));                     \
+}                                                                   \
+void boundscheck_##size (unsigned long ptrInt,                      \
+                        unsigned long accessSize) {                 \
+    meta##size *boundsptr = boundsptr_##size(ptrInt);               \
+    if (unlikely(boundsptr == NULL))                                \
+        return;                                                     \
+    meta##size metadata = *boundsptr;                               \
+    CHECK_BOUNDS(size, metadata, ptrInt, ptrInt + accessSize)       \
+}                                                                   \
+void boundscheck_range_##size (unsigned long start,                 \
+                        unsigned long end) {                        \
+    if (unlikely(start >= end))                                     \
+        return;                                                     \
+    meta##size *boundsptr = boundsptr_##size(start);                \
+    if (unlikely(boundsptr == NULL))                                \
+        return;                                                     \
+    meta##size metadata = *boundsptr;                               \
+    CHECK_BOUNDS(size, metadata, start, end)                        \
+}
+
+#endif /* !MIDFAT_POINTERS */
+
+/* 8-byte bounds hold 32-bit addresses */
+#if !defined(MIDFAT_POINTERS) || PTR_BITS == 32
+CREATE_BOUNDSCHECK(8)
+#endif
+CREATE_BOUNDSCHECK(16)
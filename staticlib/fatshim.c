@@ -0,0 +1,88 @@
+#include <string.h>
+#include <metadata.h>
+
+/*
+ * Fat-pointer tolerant versions of hot string and memory functions. Calls to
+ * these are redirected here by the external function model (see
+ * llvm-plugins/models/libc.model), so the call sites need no masking code.
+ * Masking keeps the overflow bit, so out-of-bounds pointers still fault.
+ * Returned pointers that are derived from an argument get its high bits
+ * back, as if the pointer arithmetic happened in instrumented code.
+ */
+
+#define FATSHIM_MASK (PTR_MASK | (1ULL << 63))
+
+#define MASK(ptr)       ((void*)((unsigned long)(ptr) & FATSHIM_MASK))
+#define HIGHBITS(ptr)   ((unsigned long)(ptr) & ~PTR_MASK)
+#define REFAT(res, ptr) ((res) ? (void*)((unsigned long)(res) | HIGHBITS(ptr)) : NULL)
+
+void *midfat_memcpy(void *dst, const void *src, size_t n) {
+    memcpy(MASK(dst), MASK(src), n);
+    return dst;
+}
+
+void *midfat_memmove(void *dst, const void *src, size_t n) {
+    memmove(MASK(dst), MASK(src), n);
+    return dst;
+}
+
+void *midfat_memset(void *dst, int c, size_t n) {
+    memset(MASK(dst), c, n);
+    return dst;
+}
+
+int midfat_memcmp(const void *a, const void *b, size_t n) {
+    return memcmp(MASK(a), MASK(b), n);
+}
+
+void *midfat_memchr(const void *s, int c, size_t n) {
+    return REFAT(memchr(MASK(s), c, n), s);
+}
+
+size_t midfat_strlen(const char *s) {
+    return strlen(MASK(s));
+}
+
+size_t midfat_strnlen(const char *s, size_t n) {
+    return strnlen(MASK(s), n);
+}
+
+int midfat_strcmp(const char *a, const char *b) {
+    return strcmp(MASK(a), MASK(b));
+}
+
+int midfat_strncmp(const char *a, const char *b, size_t n) {
+    return strncmp(MASK(a), MASK(b), n);
+}
+
+char *midfat_strcpy(char *dst, const char *src) {
+    strcpy(MASK(dst), MASK(src));
+    return dst;
+}
+
+char *midfat_strncpy(char *dst, const char *src, size_t n) {
+    strncpy(MASK(dst), MASK(src), n);
+    return dst;
+}
+
+char *midfat_strcat(char *dst, const char *src) {
+    strcat(MASK(dst), MASK(src));
+    return dst;
+}
+
+char *midfat_strncat(char *dst, const char *src, size_t n) {
+    strncat(MASK(dst), MASK(src), n);
+    return dst;
+}
+
+char *midfat_strchr(const char *s, int c) {
+    return REFAT(strchr(MASK(s), c), s);
+}
+
+char *midfat_strrchr(const char *s, int c) {
+    return REFAT(strrchr(MASK(s), c), s);
+}
+
+char *midfat_strstr(const char *haystack, const char *needle) {
+    return REFAT(strstr(MASK(haystack), MASK(needle)), haystack);
+}
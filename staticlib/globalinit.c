@@ -13,6 +13,25 @@
 
 __attribute__ ((visibility("hidden"))) extern char _end;
 
+/* Fully static builds (shrinkaddrspace/static_start.c) have no dynamic loader
+ * to find the executable and link the main stack into .bss */
+__attribute__ ((weak, visibility("hidden"))) extern char __executable_start[];
+__attribute__ ((weak, visibility("hidden"))) extern char __shrink_stack_start[];
+__attribute__ ((weak, visibility("hidden"))) extern char __shrink_stack_end[];
+
+/* Deep metadata of globals, emitted by GlobalTracker with -globaltracker-static */
+struct global_metadata_record {
+    unsigned long ptr;
+    unsigned long size;
+    unsigned long metadata;
+};
+
+__attribute__ ((weak, visibility("hidden"))) extern struct global_metadata_record __start_midfat_globalmeta[];
+__attribute__ ((weak, visibility("hidden"))) extern struct global_metadata_record __stop_midfat_globalmeta[];
+
+unsigned long metaset_alignment_safe_8(unsigned long ptrInt, unsigned long count, meta8 value, unsigned long alignment);
+unsigned long metaset_fixed_8(unsigned long ptrInt, unsigned long count, meta8 value);
+
 __attribute__((visibility ("hidden"), constructor(-1))) void initialize_global_metadata() {
     static int initialized;
 
@@ -24,12 +43,21 @@ __attribute__((visibility ("hidden"), constructor(-1))) void initialize_global_m
 	/* code, data, bss, ... all assumed to be together */
         Dl_info info = {};
         if (!dladdr(initialize_global_metadata, &info)) {
-            perror("initialize_global_metadata: dladdr failed");
-	    exit(-1);
+            if (!__executable_start) {
+                perror("initialize_global_metadata: dladdr failed");
+	        exit(-1);
+            }
+            info.dli_fbase = __executable_start;
         }
 	char *global_start = info.dli_fbase;
-	char *global_end = &_end;
-	initialize_metadata(global_start, global_end);
+	if (__shrink_stack_start) {
+	    /* the stack is page-aligned, with globals on either side */
+	    initialize_metadata(global_start, __shrink_stack_start);
+	    if (__shrink_stack_end < &_end)
+	        initialize_metadata(__shrink_stack_end, &_end);
+	} else {
+	    initialize_metadata(global_start, &_end);
+	}
 
 	/* stack metadata should not be used as objects are supposed to be moved
 	 * to an alternative stack, but we need to be prepared for callbacks
@@ -43,7 +71,19 @@ __attribute__((visibility ("hidden"), constructor(-1))) void initialize_global_m
 	char *stack_end;
 	__asm__("mov %%rsp, %0" : "=R" (stack_end));
 	char *stack_start = stack_end - rlim.rlim_cur;
-	initialize_metadata(stack_start, stack_end);
+	if (__shrink_stack_start) {
+	    stack_start = __shrink_stack_start;
+	    stack_end = __shrink_stack_end;
+	}
+	initialize_lazy_metadata(stack_start, stack_end);
+    }
+
+    for (struct global_metadata_record *record = __start_midfat_globalmeta;
+            record < __stop_midfat_globalmeta; record++) {
+        if (is_fixed_compression())
+            metaset_fixed_8(record->ptr, record->size, record->metadata);
+        else
+            metaset_alignment_safe_8(record->ptr, record->size, record->metadata, GLOBALALIGN);
     }
     return;
 }
@@ -1,4 +1,5 @@
 #include <metadata.h>
+#include <metapagetable_core.h>
 
 #define unlikely(x)     __builtin_expect((x),0)
 
@@ -13,3 +14,52 @@ CREATE_METACHECK(1)
 CREATE_METACHECK(2)
 CREATE_METACHECK(4)
 CREATE_METACHECK(8)
+
+/*
+ * Check the metadata of all bytes in [start, end) at once, for stores in
+ * loops whose address range is known before the loop runs.
+ */
+#ifdef MIDFAT_POINTERS
+
+/* all granules of an object share the metadata behind the fat pointer */
+#define CREATE_METACHECK_RANGE(size)                        \
+void metacheck_range_##size (unsigned long start,           \
+                        unsigned long end,                  \
+                        meta##size value) {                 \
+    meta##size metadata = (start >> PTR_BITS) ?             \
+        *(meta##size *)METAPTR_DECODE(start, size) : 0;     \
+    if (unlikely(start < end && metadata != value))         \
+        __builtin_trap();                                   \
+}
+
+#else
+
+#define CREATE_METACHECK_RANGE(size)                        \
+void metacheck_range_##size (unsigned long start,           \
+                        unsigned long end,                  \
+                        meta##size value) {                 \
+    while (start < end) {                                   \
+        unsigned long page = start / METALLOC_PAGESIZE;     \
+        unsigned long pageBase = page * METALLOC_PAGESIZE;  \
+        unsigned long pageEnd = pageBase + METALLOC_PAGESIZE;\
+        unsigned long last = end < pageEnd ? end : pageEnd; \
+        unsigned long entry = lookup_metapagetable_entry(page); \
+        unsigned long alignment = entry & 0xFF;             \
+        meta##size *metabase = (meta##size *)(entry >> 8);  \
+        unsigned long first = (start - pageBase) >> alignment;\
+        unsigned long count = ((last - 1 - pageBase) >>     \
+                                alignment) - first + 1;     \
+        for (unsigned long i = 0; i < count; ++i) {         \
+            if (unlikely(metabase[first + i] != value))     \
+                __builtin_trap();                           \
+        }                                                   \
+        start = last;                                       \
+    }                                                       \
+}
+
+#endif /* !MIDFAT_POINTERS */
+
+CREATE_METACHECK_RANGE(1)
+CREATE_METACHECK_RANGE(2)
+CREATE_METACHECK_RANGE(4)
+CREATE_METACHECK_RANGE(8)
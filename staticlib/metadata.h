@@ -22,8 +22,30 @@ typedef struct{
 #define STACKALIGN ((unsigned long)6)
 #define STACKALIGN_LARGE ((unsigned long)12)
 #define GLOBALALIGN ((unsigned long)3)
-#define PTR_BITS ((unsigned long long)32)
+
+/*
+ * Fat pointers keep the address in the low PTR_BITS bits (make PTR_BITS=<n>)
+ * and the metadata pointer in the high bits. With 32 address bits the high
+ * bits hold the metadata pointer itself. With more, they hold its offset from
+ * METADATA_ARENA (metapagetable_core.h) in metadata slots of slotsize bytes.
+ * The top bit stays clear for overflow detection, so 36 bits leave room for
+ * 1 GiB of 8-byte metadata, 40 bits for 64 MiB.
+ *
+ * With deep metadata, the high bits refer to the deep metadata object of the
+ * allocation instead of its metadata slot, encoded with a slot size of
+ * DEEPMETA_ALIGN (deep metadata objects are at least that aligned).
+ */
+#ifndef PTR_BITS
+#define PTR_BITS 32
+#endif
 #define PTR_MASK ((unsigned long long)(-1LL) >> (64 - PTR_BITS))
+#define METAPTR_SHIFT(slotsize) (PTR_BITS > 32 ? __builtin_ctzll(slotsize) : 0)
+#define METAPTR_BASE (PTR_BITS > 32 ? METADATA_ARENA : 0)
+#define METAPTR_ENCODE(metaptr, slotsize) \
+    (((unsigned long)(metaptr) - METAPTR_BASE) >> METAPTR_SHIFT(slotsize))
+#define METAPTR_DECODE(ptrInt, slotsize) \
+    (METAPTR_BASE + (((unsigned long)(ptrInt) >> PTR_BITS) << METAPTR_SHIFT(slotsize)))
+#define DEEPMETA_ALIGN sizeof(unsigned long)
 
 #define META_FUNCTION_NAME_INTERNAL(function, size) #function"_"#size
 #define META_FUNCTION_NAME(function, size) META_FUNCTION_NAME_INTERNAL(function, size)
@@ -40,8 +62,13 @@ static char const *METADATAFUNCS[] = {  "metaset_1", "metaset_2", "metaset_4", "
                                         "metaget_base_1", "metaget_base_2", "metaget_base_4", "metaget_base_8", "metaget_base_16",
                                         "metaget_base_deep_8", "metaget_base_deep_16", "metaget_base_deep_32",
                                         "metacheck_1", "metacheck_2", "metacheck_4", "metacheck_8", "metacheck_16",
-                                        "initialize_global_metadata", "initialize_metadata", "unsafe_stack_alloc_meta", "unsafe_stack_free_meta",
-                                        "meta_report_stats"};
+                                        "metacheck_range_1", "metacheck_range_2", "metacheck_range_4", "metacheck_range_8",
+                                        "boundscheck_8", "boundscheck_16", "boundscheck_range_8", "boundscheck_range_16",
+                                        "initialize_global_metadata", "initialize_module_global_metadata", "initialize_metadata", "unsafe_stack_alloc_meta", "unsafe_stack_free_meta",
+                                        "meta_report_stats",
+                                        "midfat_memcpy", "midfat_memmove", "midfat_memset", "midfat_memcmp", "midfat_memchr",
+                                        "midfat_strlen", "midfat_strnlen", "midfat_strcmp", "midfat_strncmp", "midfat_strcpy", "midfat_strncpy",
+                                        "midfat_strcat", "midfat_strncat", "midfat_strchr", "midfat_strrchr", "midfat_strstr"};
 __attribute__ ((unused)) static int ISMETADATAFUNC(const char *name) {
     for (unsigned int i = 0; i < (sizeof(METADATAFUNCS) / sizeof(METADATAFUNCS[0])); ++i) {
         int different = 0;
@@ -3,7 +3,7 @@
 #include <metadata.h>
 #include <metapagetable_core.h>
 
-static void initialize_metadata(char *start, char *end) {
+static void initialize_metadata_range(char *start, char *end, int lazy) {
         if (start > end) {
             fprintf(stderr, "initialize_metadata: bad address range %p-%p\n", start, end);
 	    exit(-1);
@@ -13,7 +13,18 @@ static void initialize_metadata(char *start, char *end) {
         unsigned long page_align_mask = ~((unsigned long)METALLOC_PAGESIZE - 1);
         char *aligned_start = (void*)((unsigned long)start & page_align_mask);
         unsigned long aligned_size = ((end - aligned_start) + page_align_offset) & page_align_mask;
+        if (lazy && register_lazy_metadata_region(aligned_start, aligned_size, GLOBALALIGN))
+            return;
         void *metadata = allocate_metadata(aligned_size, GLOBALALIGN);
         set_metapagetable_entries(aligned_start, aligned_size, metadata, GLOBALALIGN);
 }
 
+static void initialize_metadata(char *start, char *end) {
+        initialize_metadata_range(start, end, 0);
+}
+
+/* For stacks, pagetable entries are written when first looked up */
+static void initialize_lazy_metadata(char *start, char *end) {
+        initialize_metadata_range(start, end, 1);
+}
+
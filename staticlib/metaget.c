@@ -6,7 +6,7 @@
 
 unsigned long metabaseget (unsigned long ptrInt) {
     unsigned long page = ptrInt / METALLOC_PAGESIZE;
-    unsigned long entry = pageTable[page];
+    unsigned long entry = lookup_metapagetable_entry(page);
     return entry;
 }
 
@@ -36,14 +36,13 @@ __attribute__((destructor)) static void meta_report_stats (void) {
 
 #define CREATE_METAGET(size)                                  \
 meta##size metaget_##size (unsigned long ptrInt) {            \
-    meta##size *metaptr = (meta##size *)(ptrInt >> PTR_BITS); \
-    if (unlikely(metaptr == 0)) {                             \
+    if (unlikely((ptrInt >> PTR_BITS) == 0)) {                \
         METACOUNT(metaget_fail);                              \
         meta##size zero = {0};                                \
         return zero;                                          \
     }                                                         \
     METACOUNT(metaget_success);                               \
-    return *metaptr;                                          \
+    return *(meta##size *)METAPTR_DECODE(ptrInt, size);       \
 }
 
 #else
@@ -51,7 +50,7 @@ meta##size metaget_##size (unsigned long ptrInt) {            \
 #define CREATE_METAGET(size)                        \
 meta##size metaget_##size (unsigned long ptrInt) {  \
     unsigned long page = ptrInt / METALLOC_PAGESIZE;\
-    unsigned long entry = pageTable[page];          \
+    unsigned long entry = lookup_metapagetable_entry(page); \
     /*if (unlikely(entry == 0)) {                     \
         meta##size zero;                            \
         for (int i = 0; i < sizeof(meta##size) /    \
@@ -79,10 +78,18 @@ CREATE_METAGET(16)
 
 #ifdef MIDFAT_POINTERS
 
-/* FIXME: deep metadata doesn't actually work for fat pointers */
-#define CREATE_METAGET_DEEP(size)                       \
-meta##size metaget_deep_##size (unsigned long ptrInt) { \
-    return *(meta##size *)(ptrInt >> PTR_BITS);         \
+/* The high bits refer to the deep metadata object itself, which MidFatPtrs
+ * resolves from the metadata slot when the object is allocated */
+#define CREATE_METAGET_DEEP(size)                             \
+meta##size metaget_deep_##size (unsigned long ptrInt) {       \
+    if (unlikely((ptrInt >> PTR_BITS) == 0)) {                \
+        METACOUNT(metaget_fail);                              \
+        meta##size zero = {0};                                \
+        return zero;                                          \
+    }                                                         \
+    METACOUNT(metaget_success);                               \
+    return *(meta##size *)METAPTR_DECODE(ptrInt,              \
+                                         DEEPMETA_ALIGN);     \
 }
 
 #else
@@ -90,7 +97,7 @@ meta##size metaget_deep_##size (unsigned long ptrInt) { \
 #define CREATE_METAGET_DEEP(size)                       \
 meta##size metaget_deep_##size (unsigned long ptrInt) { \
     unsigned long page = ptrInt / METALLOC_PAGESIZE;    \
-    unsigned long entry = pageTable[page];              \
+    unsigned long entry = lookup_metapagetable_entry(page); \
     /*if (unlikely(entry == 0)) {                         \
         meta##size zero;                                \
         for (int i = 0; i < sizeof(meta##size) /        \
@@ -119,8 +126,8 @@ meta##size metaget_deep_##size (unsigned long ptrInt) { \
 #endif /* !MIDFAT_POINTERS */
 
 CREATE_METAGET_DEEP(8)
-//CREATE_METAGET_DEEP(16)
-//CREATE_METAGET_DEEP(32)
+CREATE_METAGET_DEEP(16)
+CREATE_METAGET_DEEP(32)
 
 #define CREATE_METAGET_FIXED(size)                          \
 meta##size metaget_fixed_##size (unsigned long ptrInt) {    \
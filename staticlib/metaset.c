@@ -5,7 +5,7 @@
 unsigned long metaset_##size (unsigned long ptrInt, \
         unsigned long count, meta##size value) {    \
     unsigned long page = ptrInt / METALLOC_PAGESIZE;\
-    unsigned long entry = pageTable[page];          \
+    unsigned long entry = lookup_metapagetable_entry(page); \
     unsigned long alignment = entry & 0xFF;         \
     char *metabase = (char*)(entry >> 8);           \
     unsigned long pageOffset = ptrInt -             \
@@ -35,7 +35,7 @@ unsigned long metaset_alignment_##suffix##size (    \
         unsigned long count, meta##size value,      \
         unsigned long alignment) {                  \
     unsigned long page = ptrInt / METALLOC_PAGESIZE;\
-    unsigned long entry = pageTable[page];          \
+    unsigned long entry = lookup_metapagetable_entry(page); \
     METASET_CHECK                                   \
     char *metabase = (char*)(entry >> 8);           \
     unsigned long pageOffset = ptrInt -             \
@@ -10,6 +10,10 @@ void unsafe_stack_alloc_meta(void *addr, unsigned long size, bool islarge) {
         unsigned long alignment = STACKALIGN;
         if (islarge)
             alignment = STACKALIGN_LARGE;
+        /* Most of a stack is never used, so only write the pagetable
+         * entries of the parts it grows into */
+        if (register_lazy_metadata_region(addr, size, alignment))
+            return;
         void *metadata = allocate_metadata(size, alignment);
         set_metapagetable_entries(addr, size, metadata, alignment);
     }
@@ -20,6 +24,8 @@ void unsafe_stack_free_meta(void *unsafe_stack_start, unsigned long unsafe_stack
         unsigned long alignment = STACKALIGN;
         if (islarge)
             alignment = STACKALIGN_LARGE;
+        if (unregister_lazy_metadata_region(unsafe_stack_start))
+            return;
         deallocate_metadata(unsafe_stack_start, unsafe_stack_size, alignment);
     }
 }